@@ -101,7 +101,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 		.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
 		.InterfaceNumber        = INTERFACE_ID_Emitter,
 		.AlternateSetting       = 0,
-		.TotalEndpoints         = 4,
+		.TotalEndpoints         = 5,
 		.Class                  = 0xFF,
 		.SubClass               = 0x00,
 		.Protocol               = 0x00,
@@ -140,6 +140,14 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 		.EndpointSize           = EMITTER_EPSIZE,
 		.PollingIntervalMS      = 0x01
 	},
+	.Emitter_StatsEp_In =
+	{
+		.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+		.EndpointAddress        = EMITTER_EP_STATS_IN,
+		.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+		.EndpointSize           = EMITTER_EPSIZE,
+		.PollingIntervalMS      = 0x0A
+	},
 };
 
 
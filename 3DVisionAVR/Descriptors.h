@@ -45,6 +45,8 @@
 	#define EMITTER_EP_CONTROL_OUT			(ENDPOINT_DIR_OUT | 2)
 	#define EMITTER_EP_BUTTON_IN			(ENDPOINT_DIR_IN  | 2)
 	#define EMITTER_EP_CONTROL_IN			(ENDPOINT_DIR_IN  | 4)
+	// Emitter specific. Each hardware endpoint has one direction, EP2 is CONTROL_OUT's
+	#define EMITTER_EP_STATS_IN				(ENDPOINT_DIR_IN  | 3)
 	#define EMITTER_EPSIZE					32
 
 /* Type Defines: */
@@ -62,6 +64,7 @@
 		USB_Descriptor_Endpoint_t			Emitter_TransmitEp_In;
 		USB_Descriptor_Endpoint_t			Emitter_ControlEp_Out;
 		USB_Descriptor_Endpoint_t			Emitter_ControlEp_In;
+		USB_Descriptor_Endpoint_t			Emitter_StatsEp_In;
 	} USB_Descriptor_Configuration_t;
 
 	/** Enum for the device interface descriptor IDs within the device. Each interface descriptor
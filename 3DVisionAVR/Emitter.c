@@ -29,26 +29,54 @@
 */
 
 #include "Emitter.h"
+#include "Timers.h"
+#include "Profile.h"
 
 /* Driver-specific vars */
 static uint8_t command = 0;
 static uint8_t offset = 0;
 static uint8_t amount = 0;
 static uint8_t dataBuff[EMITTER_EPSIZE];
+static uint8_t replyBuff[EMITTER_EPSIZE];
+static uint8_t replyLength = 0; // Reply waiting for a free EMITTER_EP_CONTROL_IN bank, 0 = none
+static uint8_t swapBuff[8]; // Only used from USB_COM_vect
 static uint8_t ramx22[2];
 static uint8_t ramx18[3];
+static uint8_t uploadStatus = IR_UPLOAD_OK;
 
-/* Time keeping */
-volatile uint32_t millisPassed = 0;
+static volatile uint8_t events = 0; // EVENT_* posted by the ISRs
+static void tickTimeout(void);
+static Timer_Event_t tickTimer = { .handler = tickTimeout };
 
-/* Serial out */
-volatile uint8_t serBuff[256];
-volatile uint8_t serBuffTail = 0;
-volatile uint8_t serBuffHead = 0;
-volatile bool serTxActive = false;
+/* USB bus time, Timer1 latched on every Start-of-Frame */
+volatile uint16_t sofStamp = 0;
+volatile bool sofHeld = false; // SOF interrupt held off by an IR edge, the late handler stamps the predicted time
+static volatile uint16_t swapStamp = 0; // SOF of the frame the pending swap packet came in
+static volatile bool swapStamped = false;
+static uint32_t sofSum = 0;
+static uint8_t sofCount = 0;
+volatile int16_t sofDrift = 0; // Crystal against host clock in ppm, positive = AVR fast
+
+/* Serial out: 256-byte ring so the indices wrap on their own. Head is only moved by
+   UART_Write, tail only by the UDRE interrupt */
+static volatile uint8_t serBuff[256];
+static volatile uint8_t serBuffTail = 0;
+static volatile uint8_t serBuffHead = 0;
+volatile uint16_t uartDropped = 0; // Bytes refused because the ring was full, saturates
+
+/* Statistics snapshots */
+static uint16_t statsInterval; // Ticks, 0 = off
+static volatile bool statsDue = false; // Snapshot to take, set by statsTimer
+static void statsTimeout(void);
+static Timer_Event_t statsTimer = { .handler = statsTimeout };
+static uint8_t statsPage = STATS_PAGES; // Next page of the snapshot being sent, STATS_PAGES when done
+static uint8_t statsSequence = 0;
+static IR_Stats_t stats;
+static uint16_t statsDropped;
 
 /** Main program entry point. This routine configures the hardware required by the application, then
- *  enters a loop to run the application tasks in sequence.
+ *  enters a loop that runs the tasks the ISRs post and sleeps in between. IR frames are timed by
+ *  the sync and timer ISRs, so nothing here is on the critical path.
  */
 int main(void)
 {
@@ -56,49 +84,99 @@ int main(void)
 
 	SetupUSBHardware();
 	IR_Init();
+	setStatsInterval(STATS_INTERVAL);
 	GlobalInterruptEnable();
 
+	set_sleep_mode(SLEEP_MODE_IDLE);
 	for (;;)
 	{
-		USB_USBTask();
+		PROFILE_LOOP();
+		GlobalInterruptDisable();
+		uint8_t pending = events;
+		events = 0;
+		if (!pending)
+		{
+			sleep_enable();
+			GlobalInterruptEnable(); // SEI delays interrupts by one instruction, no event slips in before SLEEP
+			sleep_cpu();
+			sleep_disable();
+			continue;
+		}
+		GlobalInterruptEnable();
 
-		uint32_t curtime = millisPassed;
-		IR_Update(curtime);		
-		
-		// TODO handle unconfigured state properly: LEDs, reduced power mode etc.
+		if (pending & EVENT_TICK)
+			IR_Update();
+
+		// Unconfigured or suspended: nothing arrives, the IR side keeps running on its own
 		if (USB_DeviceState != DEVICE_STATE_Configured)
 			continue;
 
-		/* Control / setup */
+		if (pending & EVENT_TICK)
+		{
+			Endpoint_SelectEndpoint(EMITTER_EP_STATS_IN);
+			if (Endpoint_IsINReady())
+				statsTask();
+		}
+
+		// The host hasn't read the last reply yet, further commands wait in their banks
+		if (replyLength && !sendReply())
+			continue;
+
+		/* Control / setup. Swap packets are handled in USB_COM_vect */
 		Endpoint_SelectEndpoint(EMITTER_EP_CONTROL_OUT); // Commands to emitter
 		if (Endpoint_IsOUTReceived() && Endpoint_IsConfigured() && Endpoint_IsReadWriteAllowed())
 		{
 			Endpoint_Read_Stream_LE(dataBuff, Endpoint_BytesInEndpoint(), NULL);
 			Endpoint_ClearOUT();
+			bitSet(UEIENX, RXOUTE); // Masked by USB_COM_vect until the bank is read
 			
 			command = dataBuff[0];
 			offset = dataBuff[1];
 			amount = dataBuff[2];
-			if (command & 0x01) // Write
+			TRACE(TRACE_COMMAND, command | (offset << 8));
+			if (command == CMD_STATS_RATE)
 			{
-				if (offset == 0x22)
-					memcpy(ramx22, dataBuff+4, amount);
-				else if (offset == 0x18)
-					memcpy(ramx18, dataBuff+4, amount);
+				setStatsInterval(offset * 10);
 			}
-			else if (command & 0x02) // Read
-			{				
-				Endpoint_SelectEndpoint(EMITTER_EP_CONTROL_IN); // To emitter
-				Endpoint_WaitUntilReady();
-				returnData();
+			else if (command == CMD_FREERUN_RATE)
+			{
+				uploadStatus = IR_SetFreerunRate(dataBuff[4] | ((uint32_t)dataBuff[5] << 8) | ((uint32_t)dataBuff[6] << 16) | ((uint32_t)dataBuff[7] << 24));
+			}
+			else if (command == CMD_FLYWHEEL)
+			{
+				IR_SetFlywheel(offset);
+			}
+			else if (command == CMD_PROFILE)
+			{
+				profileCommand();
+			}
+			else if ((command & 0xF0) == CMD_PROTOCOL_WRITE) // Emitter specific
+			{
+				protocolCommand();
 			}
-			if (command & 0x40) // Clear
+			else
 			{
-				if (offset == 0x22)
-					memset(ramx22, 0, amount);
-				else if (offset == 0x18)
-					memset(ramx18, 0, amount);
+				if (command & 0x01) // Write
+				{
+					if (offset == 0x22)
+						memcpy(ramx22, dataBuff+4, amount);
+					else if (offset == 0x18)
+						memcpy(ramx18, dataBuff+4, amount);
+				}
+				else if (command & 0x02) // Read
+				{
+					returnData();
+				}
+				if (command & 0x40) // Clear
+				{
+					if (offset == 0x22)
+						memset(ramx22, 0, amount);
+					else if (offset == 0x18)
+						memset(ramx18, 0, amount);
+				}
 			}
+			if (replyLength)
+				sendReply();
 		}
 		//Endpoint_SelectEndpoint(EMITTER_CONTROLEP_IN); // Back to PC
 		//if (Endpoint_IsConfigured() && Endpoint_IsINReady() && Endpoint_IsReadWriteAllowed())
@@ -107,37 +185,6 @@ int main(void)
 		//	returnData();
 		//	Endpoint_ClearIN();
 		//}
-		
-		Endpoint_SelectEndpoint(EMITTER_EP_BUTTON_IN);
-		if (Endpoint_IsINReady())
-		{
-			//Endpoint_Write_Stream_LE(dataBuff, 8, NULL);
-			//Endpoint_ClearIN();
-		}
-		
-		/* Eye swap controls */
-		Endpoint_SelectEndpoint(EMITTER_EP_SWAP_OUT);
-		if (Endpoint_IsOUTReceived())
-		{			
-			Endpoint_Read_Stream_LE(dataBuff, 8, NULL);
-			Endpoint_ClearOUT();
-
-			if (IR_SyncMode & SYNCMODE_DRIVER)
-			{
-				// Eye sync packet
-				if ((dataBuff[0] == 0xAA) && ((dataBuff[1] & 0xFE) == 0xFE))
-				{
-					// 0xFE = left, 0xFF = right
-					uint8_t eye = dataBuff[1] & 1; // Flipped, too late for current frame
-					IR_SetEye(eye);
-
-					if (IR_SyncMode == SYNCMODE_DRIVER)
-					{
-						IR_StartFrame();
-					}
-				}
-			}
-		}
 	}
 }
 
@@ -168,14 +215,23 @@ void SetupUSBHardware(void)
 	bitSet(DDR_LED_ACTIVE, LED_ACTIVE);
 	//bitSet(PORT_FORCEIN, FORCEIN); // Pullup, pull low to force freerun mode
 
-	/* TIMER0 - 1khz time tracking ticks*/
-	OCR0A = 250;
-	TCCR0A = _BV(WGM01) | _BV(WGM00); // CTC mode with OCR0A top
-	TCCR0B = _BV(WGM02) | _BV(CS01) | _BV(CS00); // clk / 64
-	TIMSK0 = _BV(TOIE0); // overflow interrupt enable
-	
+	/* Unused peripherals off, less to clock while idle */
+	power_adc_disable();
+	power_spi_disable();
+	power_twi_disable();
+	power_timer0_disable();
+#ifdef EMITTER_PROFILE
+	Profile_Init(); // Timer3 counts the cycles
+#else
+	power_timer3_disable();
+#endif
+	bitSet(ACSR, ACD); // Analog comparator
+
+	/* Housekeeping tick, wakes the main loop every TICK_US */
+	tickTimeout();
+
 	/* UART */
-	UBRR1 = ((F_CPU / 8) / 115200) - 1;
+	UBRR1 = ((F_CPU / 8 + UART_BAUD / 2) / UART_BAUD) - 1;
 	UCSR1A = _BV(U2X1); // double speed mode
 	UCSR1C = _BV(UCSZ11) | _BV(UCSZ10);
 	
@@ -183,8 +239,7 @@ void SetupUSBHardware(void)
 	//bitSet(UCSR1B, RXEN0);
 	//bitSet(UCSR1B, RXCIE1);
 	bitSet(UCSR1B, TXEN1);
-	bitSet(UCSR1B, TXCIE1);
-	//bitSet(UCSR1B, UDRIE1);
+	// UDRIE1 is set by UART_Write while there is data queued
 	
 	/* Hardware Initialization */
 	USB_Init();
@@ -196,6 +251,26 @@ void EVENT_USB_Device_Connect(void)
 }
 void EVENT_USB_Device_Disconnect(void)
 {
+	bitClear(PORT_LED_STBY, LED_STBY);
+}
+
+/** Event handler for the USB_Reset event. The control endpoint was just set up again, control
+ *  requests are served from USB_COM_vect */
+void EVENT_USB_Device_Reset(void)
+{
+	Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+	bitSet(UEIENX, RXSTPE);
+}
+
+/** Bus suspend: the host is asleep, keep within the suspend current budget */
+void EVENT_USB_Device_Suspend(void)
+{
+	bitClear(PORT_LED_STBY, LED_STBY);
+}
+void EVENT_USB_Device_WakeUp(void)
+{
+	if (USB_DeviceState == DEVICE_STATE_Configured)
+		bitSet(PORT_LED_STBY, LED_STBY);
 }
 
 /** Event handler for the USB_ConfigurationChanged event. This is fired when the host set the current configuration
@@ -204,14 +279,69 @@ void EVENT_USB_Device_Disconnect(void)
 void EVENT_USB_Device_ConfigurationChanged(void)
 {
 	bool ConfigSuccess = true;
+	replyLength = 0;
 	
 	/* Setup Endpoints */
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(EMITTER_EP_SWAP_OUT,  EP_TYPE_BULK, EMITTER_EPSIZE, 1);
+	// Double banked OUT: the host can send the next packet while one is being read
+	ConfigSuccess &= Endpoint_ConfigureEndpoint(EMITTER_EP_SWAP_OUT,  EP_TYPE_BULK, EMITTER_EPSIZE, 2);
 	ConfigSuccess &= Endpoint_ConfigureEndpoint(EMITTER_EP_BUTTON_IN, EP_TYPE_INTERRUPT, EMITTER_EPSIZE, 1);
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(EMITTER_EP_CONTROL_OUT, EP_TYPE_BULK, EMITTER_EPSIZE, 1);
+	ConfigSuccess &= Endpoint_ConfigureEndpoint(EMITTER_EP_CONTROL_OUT, EP_TYPE_BULK, EMITTER_EPSIZE, 2);
 	ConfigSuccess &= Endpoint_ConfigureEndpoint(EMITTER_EP_CONTROL_IN, EP_TYPE_BULK, EMITTER_EPSIZE, 1);
+	ConfigSuccess &= Endpoint_ConfigureEndpoint(EMITTER_EP_STATS_IN, EP_TYPE_INTERRUPT, EMITTER_EPSIZE, 1);
 	if (ConfigSuccess)
 		bitSet(PORT_LED_STBY, LED_STBY);
+
+	/* OUT packets wake the main loop through USB_COM_vect */
+	Endpoint_SelectEndpoint(EMITTER_EP_SWAP_OUT);
+	bitSet(UEIENX, RXOUTE);
+	Endpoint_SelectEndpoint(EMITTER_EP_CONTROL_OUT);
+	bitSet(UEIENX, RXOUTE);
+	Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+}
+
+/** Event handler for the USB Start-of-Frame event, fired every 1ms by the host while in driver sync mode.
+ *  Latches Timer1 as the reference for swap packets and tracks the crystal's drift against the host clock.
+ */
+void EVENT_USB_Device_StartOfFrame(void)
+{
+	uint16_t now = TCNT1;
+	PROFILE_ISR(PROFILE_USB_SOF, PROFILE_NO_LATENCY);
+
+	// A swap packet still waiting now came in during the previous frame
+	if (!swapStamped)
+	{
+		uint8_t prevEndpoint = Endpoint_GetCurrentEndpoint();
+		Endpoint_SelectEndpoint(EMITTER_EP_SWAP_OUT);
+		if (Endpoint_IsOUTReceived())
+		{
+			swapStamp = sofStamp;
+			swapStamped = true;
+		}
+		Endpoint_SelectEndpoint(prevEndpoint);
+	}
+
+	uint16_t delta = now - sofStamp;
+	bool held = sofHeld;
+	sofHeld = false;
+	if ((delta > (SOF_TICKS - SOF_TOLERANCE)) && (delta < (SOF_TICKS + SOF_TOLERANCE)))
+	{
+		if (held)
+			delta = SOF_TICKS; // Handler came late, the drift sum telescopes over it anyway
+		sofStamp += delta;
+		sofSum += delta;
+		if (++sofCount == 0) // 256 frames
+		{
+			// (ticks - 256 * SOF_TICKS) / 512000 * 1e6
+			sofDrift = ((int32_t)(sofSum - 256UL * SOF_TICKS) * 125) / 64;
+			sofSum = 0;
+		}
+	}
+	else
+	{
+		sofStamp = now;
+		sofSum = 0;
+		sofCount = 0;
+	}
 }
 
 /** Event handler for the USB_ControlRequest event. This is used to catch and process control requests sent to
@@ -264,51 +394,300 @@ void EVENT_USB_Device_ControlRequest(void)
 
 void returnData(void)
 {
-	dataBuff[0] = offset;
-	dataBuff[1] = amount;
-	dataBuff[2] = 0x00;
-	dataBuff[3] = 0x04;
+	replyBuff[0] = offset;
+	replyBuff[1] = amount;
+	replyBuff[2] = 0x00;
+	replyBuff[3] = 0x04;
 	if (offset == 0x22)
-		memcpy( dataBuff+4, ramx22, amount);
+		memcpy( replyBuff+4, ramx22, amount);
 	else if (offset == 0x18)
-		memcpy(dataBuff+4, ramx18, amount);
+		memcpy(replyBuff+4, ramx18, amount);
 	else for (uint8_t i=0; i<amount; i++)
-		dataBuff[4+i] = 0x00;
+		replyBuff[4+i] = 0x00;
+	replyLength = 4+amount;
+}
 
-	Endpoint_Write_Stream_LE(dataBuff, 4+amount, NULL);
+/** Sends the queued reply if EMITTER_EP_CONTROL_IN has a free bank, never waits for the host */
+bool sendReply(void)
+{
+	Endpoint_SelectEndpoint(EMITTER_EP_CONTROL_IN);
+	if (!Endpoint_IsINReady())
+		return false;
+	Endpoint_Write_Stream_LE(replyBuff, replyLength, NULL);
 	Endpoint_ClearIN();
+	replyLength = 0;
+	return true;
 }
 
+/** IR protocol upload and selection, the host polls CMD_PROTOCOL_STATUS for the result of the last write or commit */
+void protocolCommand(void)
+{
+	if (command == CMD_PROTOCOL_WRITE)
+	{
+		if (amount > (EMITTER_EPSIZE - 4))
+			uploadStatus = IR_UPLOAD_RANGE;
+		else
+			uploadStatus = IR_UploadProtocol(offset, dataBuff+4, amount);
+	}
+	else if (command == CMD_PROTOCOL_COMMIT)
+	{
+		uploadStatus = IR_CommitProtocol(amount);
+	}
+	else if (command == CMD_PROTOCOL_SELECT)
+	{
+		uploadStatus = IR_SelectProtocol(offset);
+	}
+	else if (command == CMD_PROTOCOL_MIX)
+	{
+		uploadStatus = IR_MixProtocols(dataBuff+4, amount, offset);
+	}
+	else if (command == CMD_PROTOCOL_LEAD)
+	{
+		uploadStatus = IR_SetProtocolLead(dataBuff[4] | (dataBuff[5] << 8));
+	}
+	else if (command == CMD_PROTOCOL_STATUS)
+	{
+		replyBuff[0] = command;
+		replyBuff[1] = uploadStatus;
+		replyBuff[2] = IR_ProtocolStoring();
+		replyBuff[3] = IR_ProtocolID();
+		replyLength = 4;
+	}
+}
 
-ISR(TIMER0_OVF_vect) // 1kHz tick
+/** Reply with one vector's ISR profile, or the main loop's past the last vector. Other builds
+ *  reply with no vectors. Amount non-zero clears the profile afterwards */
+void profileCommand(void)
 {
-	millisPassed++;
+	replyBuff[0] = command;
+	replyBuff[1] = offset;
+	replyBuff[2] = 0;
+	replyBuff[3] = 0;
+	replyLength = 4;
+#ifdef EMITTER_PROFILE
+	replyBuff[2] = PROFILE_VECTORS;
+	uint32_t values[3];
+	if (offset < PROFILE_VECTORS)
+	{
+		Profile_Record_t record;
+		Profile_Read(offset, &record);
+		values[0] = record.count;
+		values[1] = record.sum;
+		values[2] = record.max;
+		memcpy(replyBuff + 16, &record.min, 2);
+		memcpy(replyBuff + 18, &record.latency, 2);
+		replyLength = 20;
+	}
+	else
+	{
+		values[0] = profileLoops;
+		values[1] = Profile_Elapsed();
+		values[2] = F_CPU;
+		replyLength = 16;
+	}
+	memcpy(replyBuff + 4, values, sizeof(values)); // Little endian, as the AVR stores them
+	if (amount)
+		Profile_Reset();
+#endif
 }
 
-ISR(USART1_TX_vect) // transmit complete
+/** Publishes a snapshot every interval ms from now on, starting right away. 0 stops them */
+void setStatsInterval(uint16_t interval)
 {
-	if (serBuffTail != serBuffHead)
-		UDR1 = serBuff[serBuffTail++];
+	statsInterval = TIMER_MS(interval);
+	statsDue = interval != 0;
+	if (interval)
+		Timer_Start(&statsTimer, statsInterval);
 	else
-		serTxActive = false;
+		Timer_Stop(&statsTimer);
 }
 
-void UART_Write(uint8_t* data, uint8_t amount)
+/** tickTimer handler, posts the housekeeping to the main loop every tick */
+static void tickTimeout(void)
 {
-	uint8_t i = 0;
-	uint8_t head = serBuffHead;
-	while (i < amount)
+	events |= EVENT_TICK;
+	Timer_Start(&tickTimer, 1);
+}
+
+/** statsTimer handler, runs from the tick interrupt */
+static void statsTimeout(void)
+{
+	statsDue = true;
+	Timer_Start(&statsTimer, statsInterval); // From this tick, so snapshots don't drift
+}
+
+/** Sends the next page of the statistics snapshot, taking a new snapshot when one is due. The
+ *  pages go out from a copy so they all describe the same moment */
+void statsTask(void)
+{
+	if (statsPage == STATS_PAGES)
+	{
+		if (!statsDue)
+			return;
+		statsDue = false; // One that fell behind is skipped
+		IR_GetStats(&stats);
+		uint_reg_t sreg = GetGlobalInterruptMask();
+		GlobalInterruptDisable();
+		statsDropped = uartDropped;
+		SetGlobalInterruptMask(sreg);
+		statsSequence++;
+		statsPage = 0;
+	}
+
+	Endpoint_Write_8(STATS_TAG);
+	Endpoint_Write_8(statsPage);
+	Endpoint_Write_8(statsSequence);
+	Endpoint_Write_8(IR_SyncMode);
+	if (statsPage == 0)
+	{
+		Endpoint_Write_32_LE(stats.frames[EYE_RIGHT]);
+		Endpoint_Write_32_LE(stats.frames[EYE_LEFT]);
+		Endpoint_Write_16_LE(stats.missed);
+		Endpoint_Write_16_LE(stats.late);
+		Endpoint_Write_16_LE(stats.timeouts);
+		Endpoint_Write_16_LE(stats.eyeFixes);
+		Endpoint_Write_16_LE(stats.framePeriod);
+		Endpoint_Write_16_LE(stats.window);
+		Endpoint_Write_16_LE(statsDropped);
+		Endpoint_Write_8(IR_ProtocolID());
+		Endpoint_Write_16_LE(stats.glitches);
+		Endpoint_Write_16_LE(stats.eyeSlips);
+	}
+	else
+	{
+		const uint16_t* histogram = (statsPage == 1) ? stats.period : stats.latency;
+		for (uint8_t i = 0; i < IR_STATS_BINS; i++)
+			Endpoint_Write_16_LE(histogram[i]);
+	}
+	Endpoint_ClearIN();
+	statsPage++;
+}
+
+/** Reads every swap packet waiting in the EMITTER_EP_SWAP_OUT banks and passes it on, from
+ *  USB_COM_vect with interrupts enabled */
+static void swapTask(void)
+{
+	Endpoint_SelectEndpoint(EMITTER_EP_SWAP_OUT);
+	while (Endpoint_IsOUTReceived())
 	{
-		uint8_t nexthead = head + 1;
-		if (nexthead == serBuffTail)
-			break;
-		serBuff[head] = data[i++];
-		serBuffHead = nexthead;
-		head++;
+		Endpoint_Read_Stream_LE(swapBuff, sizeof(swapBuff), NULL);
+
+		// Bus time the packet arrived at
+		GlobalInterruptDisable();
+		uint16_t stamp = swapStamped ? swapStamp : sofStamp;
+		if (!swapStamped && sofHeld && bit_is_set(UDINT, SOFI))
+			stamp += SOF_TICKS; // Came in after a SOF whose handler an IR edge holds off
+		swapStamped = false;
+		Endpoint_ClearOUT(); // Other bank may hold the next one already
+		GlobalInterruptEnable();
+
+		if (IR_SyncMode & SYNCMODE_DRIVER)
+		{
+			// Eye sync packet
+			if ((swapBuff[0] == 0xAA) && ((swapBuff[1] & 0xFE) == 0xFE))
+			{
+				// 0xFE = left, 0xFF = right
+				uint8_t eye = swapBuff[1] & 1; // Flipped, too late for current frame
+				TRACE(TRACE_SWAP_PACKET | eye, stamp);
+				if (IR_SyncMode == SYNCMODE_DRIVER)
+					IR_DriverSync(eye, stamp); // Frames timed by the PLL
+				else
+					IR_SetEye(eye);
+			}
+		}
+		Endpoint_SelectEndpoint(EMITTER_EP_SWAP_OUT); // Nested interrupts restore it, IR code doesn't
 	}
-	if (!serTxActive && (serBuffTail != serBuffHead))
+}
+
+/** Endpoint interrupt. Swap packets are handled right here so control traffic can't hold them
+ *  up, command packets are masked until the main loop has read them and control requests are
+ *  processed the way LUFA's INTERRUPT_CONTROL_ENDPOINT option does. The slow parts run with
+ *  interrupts enabled and their source masked, so the IR timing ISRs can preempt them. A swap
+ *  packet may interrupt a control transfer but not the other way round */
+ISR(USB_COM_vect)
+{
+	PROFILE_ISR(PROFILE_USB_COM, PROFILE_NO_LATENCY);
+	uint8_t prevEndpoint = Endpoint_GetCurrentEndpoint();
+	uint8_t pending = UEINT;
+
+	if (pending & _BV(EMITTER_EP_CONTROL_OUT))
 	{
-		UDR1 = serBuff[serBuffTail++]; // start transfer
-		serTxActive = true;
+		Endpoint_SelectEndpoint(EMITTER_EP_CONTROL_OUT);
+		bitClear(UEIENX, RXOUTE);
+		events |= EVENT_USB;
 	}
-}
\ No newline at end of file
+	if (pending & _BV(EMITTER_EP_SWAP_OUT))
+	{
+		// A SETUP waits for the swap packet, a control transfer mustn't run nested in it.
+		// Left masked if the swap packet interrupted a control transfer
+		Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+		uint8_t setup = UEIENX & _BV(RXSTPE);
+		bitClear(UEIENX, RXSTPE);
+		Endpoint_SelectEndpoint(EMITTER_EP_SWAP_OUT);
+		bitClear(UEIENX, RXOUTE);
+		GlobalInterruptEnable();
+		swapTask();
+		GlobalInterruptDisable();
+		Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+		UEIENX |= setup; // Raised at once if one came in meanwhile
+		Endpoint_SelectEndpoint(EMITTER_EP_SWAP_OUT);
+		bitSet(UEIENX, RXOUTE); // Raised again at once if a packet landed meanwhile
+	}
+	if (pending & _BV(ENDPOINT_CONTROLEP))
+	{
+		Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+		bitClear(UEIENX, RXSTPE);
+		GlobalInterruptEnable(); // Control transfers are slow, keep the IR timing ISRs going
+		USB_Device_ProcessControlRequest();
+		Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+		bitSet(UEIENX, RXSTPE);
+	}
+	Endpoint_SelectEndpoint(prevEndpoint);
+}
+
+ISR(USART1_UDRE_vect) // data register empty
+{
+	PROFILE_ISR(PROFILE_USART1_UDRE, PROFILE_NO_LATENCY);
+	uint8_t tail = serBuffTail;
+	UDR1 = serBuff[tail++];
+	serBuffTail = tail;
+	if (tail == serBuffHead)
+		bitClear(UCSR1B, UDRIE1);
+}
+
+/** Queues amount bytes for USART1, from the main loop or an ISR. All or nothing: if the ring
+ *  can't take the whole block it is counted in uartDropped and false returned */
+bool UART_Write(const uint8_t* data, uint8_t amount)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable(); // Writers from ISRs and the main loop must not interleave
+	uint8_t head = serBuffHead;
+	if ((uint8_t)(serBuffTail - head - 1) < amount)
+	{
+		uint16_t dropped = uartDropped + amount;
+		uartDropped = (dropped < amount) ? 0xFFFF : dropped;
+		SetGlobalInterruptMask(sreg);
+		return false;
+	}
+	for (uint8_t i = 0; i < amount; i++)
+		serBuff[head++] = data[i];
+	serBuffHead = head; // Publish the block at once
+	bitSet(UCSR1B, UDRIE1);
+	SetGlobalInterruptMask(sreg);
+	return true;
+}
+
+#ifdef EMITTER_TRACE
+/** Queues one trace record, from the main loop or an ISR. Dropped whole if the buffer can't take it */
+void Trace_Write(uint8_t event, uint16_t payload)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable(); // Keep records in time order
+	uint32_t now = IR_Time();
+	uint8_t record[TRACE_RECORD_SIZE] = { event, now, now >> 8, now >> 16, payload, payload >> 8, TRACE_CHECK };
+	for (uint8_t i = 0; i < (TRACE_RECORD_SIZE - 1); i++)
+		record[TRACE_RECORD_SIZE - 1] ^= record[i];
+	UART_Write(record, TRACE_RECORD_SIZE);
+	SetGlobalInterruptMask(sreg);
+}
+#endif
\ No newline at end of file
@@ -40,8 +40,10 @@
 	#include <avr/io.h>
 	#include <avr/wdt.h>
 	#include <avr/power.h>
+	#include <avr/sleep.h>
 	#include <avr/interrupt.h>
 	#include <avr/sfr_defs.h>
+	#include <avr/eeprom.h>
 
 	#include "Descriptors.h"
 	#include "LUFA/Drivers/USB/USB.h"
@@ -60,23 +62,100 @@
 	#define PIN_FORCEIN     PINB
 	#define PORT_FORCEIN    PORTB
 
-	volatile uint32_t millisPassed;
+	extern volatile int16_t sofDrift;
+	extern volatile uint16_t sofStamp;
+	extern volatile bool sofHeld;
+
+/* Diagnostics UART, TX only. U2X is on, so F_CPU/8 divided by the baud rate should be
+   close to a whole number: 1M and 2M are exact at 16MHz, 115200 is 2.1% off */
+	#define UART_BAUD       1000000
+	extern volatile uint16_t uartDropped;
+
+/* Main loop work posted by the ISRs, the CPU idles in between */
+	#define EVENT_USB       _BV(0) // Command packet on EMITTER_EP_CONTROL_OUT
+	#define EVENT_TICK      _BV(1) // Housekeeping: window, EEPROM, statistics pages. Posted by the timer wheel every tick
+	#define TICK_US         32768  // Timer1 overflow drives Timers.h, no interrupt of its own to hold IR or sync edges back
+
+/* USB bus time */
+	#define SOF_TICKS       2000 // Timer1 ticks per 1ms USB frame
+	#define SOF_TOLERANCE   100  // Larger deviations are missed/resumed frames, not drift
+	#define SOF_SHADOW_PRE  8    // Software IR edges due from this far before the next SOF stamp...
+	#define SOF_SHADOW_POST 24   // ...to this far after it hold the SOF interrupt off until they're out
+
+/* Emitter specific commands on EMITTER_EP_CONTROL_OUT, unused by the driver: [command, offset, amount, 0, data] */
+	#define CMD_PROTOCOL_WRITE   0x90 // Upload amount bytes of a protocol image at offset
+	#define CMD_PROTOCOL_COMMIT  0x91 // Validate and switch to the uploaded image of length amount, then store it
+	#define CMD_PROTOCOL_STATUS  0x92 // Reply on EMITTER_EP_CONTROL_IN: [command, IR_UploadStatus_t, storing, IR_ProtocolID_t]
+	#define CMD_PROTOCOL_SELECT  0x93 // Switch to built-in protocol offset (IR_ProtocolID_t) and store the choice
+	#define CMD_STATS_RATE       0x94 // Publish a statistics snapshot every offset * 10ms rounded up to ticks, 0 = off. One page goes out a tick
+	#define CMD_PROTOCOL_MIX     0x95 // Also send the amount built-in protocols listed in data, offset: gap in us (0 = default)
+	#define CMD_FREERUN_RATE     0x96 // Free-run frame rate in mHz, data: 32 bits, 50-150Hz. Others are refused, see CMD_PROTOCOL_STATUS
+	#define CMD_FLYWHEEL         0x97 // Keep up to offset predicted frames going across a sync dropout, 0 = off
+	#define CMD_PROTOCOL_LEAD    0x98 // Send the active protocol's opening token data (16 bits signed) us ahead of the frame edge, kept for that protocol
+	#define CMD_PROFILE          0x99 // Reply on EMITTER_EP_CONTROL_IN with the ISR profile of vector offset, see below
+
+/* Sync statistics on EMITTER_EP_STATS_IN, read by tools/stats_reader.py. A snapshot is STATS_PAGES
+   packets of [STATS_TAG, page, sequence, IR_SyncMode, data], little endian:
+   page 0: frames right, frames left (32 bits), missed, late, timeouts, eye fixes, frame period,
+           window, UART bytes dropped (16 bits), protocol ID (8 bits), sync glitches, eye slips (16 bits)
+   page 1: frame interval error histogram, page 2: sync to first pulse histogram (IR_Stats_t) */
+	#define STATS_INTERVAL  0    // Boot default in ms, off: the stock driver doesn't expect these packets
+	#define STATS_TAG       0x53
+	#define STATS_PAGES     3
+
+/* Binary event trace on USART1, decoded by tools/trace_decode.py. Record: event, Timer1 time
+   (24 bits), payload (16 bits), check byte; little endian */
+	//#define EMITTER_TRACE
+	#define TRACE_RECORD_SIZE   7
+	#define TRACE_CHECK         0x5A // XOR of the record bytes before it and this
+
+	#define TRACE_SYNC_EDGE     0x10 // | level, payload: Timer1 time of the edge
+	#define TRACE_SYNC_GLITCH   0x18 // | level, edge dropped off the locked rate, payload: Timer1 time of the edge
+	#define TRACE_FRAME_START   0x20 // | eye, payload: Timer1 time the frame schedule starts from
+	#define TRACE_FRAME_LATE    0x28 // Frame start held up, payload: ticks the frame was shifted by
+	#define TRACE_TOKEN_START   0x30 // | token index, payload: compare time of the edge
+	#define TRACE_TOKEN_END     0x40 // | token index, payload: compare time of the edge
+	#define TRACE_SWAP_PACKET   0x50 // | eye, payload: Timer1 time of the USB frame it came in
+	#define TRACE_COMMAND       0x60 // payload: command | offset << 8
+	#define TRACE_SYNC_TIMEOUT  0x70
+
+	#ifdef EMITTER_TRACE
+		#define TRACE(event, payload) Trace_Write(event, payload)
+	#else
+		#define TRACE(event, payload)
+	#endif
+
+/* ISR profile (Profile.h), read by tools/profile_reader.py. Timer3 is taken to count cycles. CMD_PROFILE
+   replies [command, offset, PROFILE_VECTORS, 0, data], little endian, PROFILE_VECTORS 0 in other builds:
+   offset below PROFILE_VECTORS: calls, total cycles, longest (32 bits), shortest, worst entry latency (16 bits)
+   offset PROFILE_VECTORS: main loop iterations, Timer1 ticks elapsed, F_CPU (32 bits)
+   The profile is cleared after the reply if amount isn't 0 */
+	//#define EMITTER_PROFILE
 
 /* Util macros */
 	#define bitSet(addr,bit) (addr |= (1<<bit))
 	#define bitClear(addr,bit) (addr &= ~(1<<bit))
-	#define millis() (millisPassed)
 
 /* Function Prototypes: */
 	void SetupUSBHardware(void);
 
 	void EVENT_USB_Device_Connect(void);
 	void EVENT_USB_Device_Disconnect(void);
+	void EVENT_USB_Device_Reset(void);
+	void EVENT_USB_Device_Suspend(void);
+	void EVENT_USB_Device_WakeUp(void);
 	void EVENT_USB_Device_ConfigurationChanged(void);
 	void EVENT_USB_Device_ControlRequest(void);
+	void EVENT_USB_Device_StartOfFrame(void);
 
 	void returnData(void);
+	bool sendReply(void);
+	void protocolCommand(void);
+	void profileCommand(void);
+	void statsTask(void);
+	void setStatsInterval(uint16_t interval);
 	
-	void UART_Write(uint8_t* data, uint8_t amount);
+	bool UART_Write(const uint8_t* data, uint8_t amount);
+	void Trace_Write(uint8_t event, uint16_t payload);
 
 #endif /* _EMITTER_H_ */
@@ -1,82 +1,313 @@
 
 #include "Emitter.h"
 #include "IRProtocols.h"
+#include "Timers.h"
+#include "Profile.h"
+#include <avr/pgmspace.h>
 
 #define START_IR_TIMER() (TCCR1B =  _BV(CS11)) // 16MHz / 8 = 0.5us ticks
-#define STOP_IR_TIMER()  (TCCR1B = 0)
 
-const IR_Protocol_t* IR_CurProtocol = &IRProt_3DVision;
 SyncMode_t IR_SyncMode = SYNCMODE_NONE;
 
 static volatile bool emitterActive = false;
-static bool emitterActive_last = false;
 static volatile bool synced = false;
-static volatile uint32_t lastFrame = 0;
+
+static volatile uint16_t timeHigh = 0; // Timer1 overflows, upper half of IR_Time()
+
+// Frame rate without any sync source until set over USB, in mHz
+#define FREERUN_RATE    120000UL
+#define SYNC_TIMEOUT    200 // ms without a frame, restarted by every one
+// Predicted frames sent across a sync dropout until set over USB, 100ms at 120Hz
+#define FLYWHEEL_FRAMES 12
+#define PERIOD_MIN      (2000000UL / 150) // Fastest accepted refresh, in ticks
+#define PERIOD_MAX      (2000000UL / 50)  // Slowest accepted refresh
+
+// Shutter open window limits, rebuilt only once it moved by more than IR_WINDOW_STEP
+#define IR_WINDOW_MIN    TICKS_MS(1)
+#define IR_WINDOW_STEP   (2*10)
+#define PERIOD_AVG_SHIFT 3 // Sync edge intervals are averaged over about 2^n frames
+
+// External sync rate detection. Frames follow every edge while the intervals between the
+// first SYNC_DETECT_EDGES are collected, the fullest histogram bin gives the refresh period.
+// Locked, an edge further than SYNC_WINDOW from its predicted time is dropped as a glitch
+// unless it follows an earlier dropped edge by a period: then the display phase moved.
+// SYNC_MAX_GLITCHES of them in a row mean the rate changed and start detection over
+#define SYNC_DETECT_EDGES  16
+#define SYNC_DETECT_BIN    (2*50)  // Histogram bin half width
+#ifdef SYNC_ICP
+#define SYNC_WINDOW        (2*20)  // Captured edge times are exact
+#else
+#define SYNC_WINDOW        (2*100) // INT1 edges are stamped as late as the ISR gets to run
+#endif
+#define SYNC_MAX_GLITCHES  8
 
 static uint8_t swapEyes = 0;
 static volatile uint8_t curEye = 0;
-static uint8_t nextEye = 0;
 
-static uint8_t lastPulse;
-static uint8_t curPulse;
-static uint8_t curToken;
+// Next frame, prepared whenever its eye or the schedule changes so starting it only
+// takes arming the timer. NULL schedule if the eye has no token
+static const uint16_t* volatile armedSchedule;
+static volatile uint8_t armedEye;
+#ifdef EMITTER_TRACE
+static const uint8_t* armedTokens;
+#endif
+
+// Ticks the first compare value has to be ahead of TCNT1 when it's set
+#define IR_MIN_LEAD       4
+// Compare match to pin write in the GPIO pulse ISRs, about 20 cycles
+#define IR_ISR_ENTRY      2
+// Rising and falling edges of the opening + closing tokens, plus terminator. With IR_MIX
+// there's room for two full size protocols, mixed ones share it with the active one
+#ifdef IR_MIX
+#define IR_SCHEDULE_SIZE  (4 * (IR_MAX_TOKEN_SIZE + 1) + 1)
+#else
+#define IR_SCHEDULE_SIZE  (2 * (IR_MAX_TOKEN_SIZE + 1) + 1)
+#endif
+
+// Absolute OCR1A/OCR1B values from frame start, alternating rising/falling edges.
+// Double buffered so a new window can be built while a frame is being sent
+static uint16_t IR_Schedule[2][2][IR_SCHEDULE_SIZE]; // [buffer][eye]
+static uint16_t (* volatile activeSchedule)[IR_SCHEDULE_SIZE] = IR_Schedule[0];
+static const uint16_t* volatile nextEdge; // NULL between frames
+static volatile uint16_t frameStart; // Timer1 time the schedule is relative to
+
+// Driver sync PLL, tick values carry PLL_FRAC_BITS fractional bits
+#define PLL_FRAC_BITS      12
+#define PLL_ACQUIRE_SHIFT  3   // 2^n packet intervals voted on for the initial period
+#define PLL_ACQUIRE_BIN    (2*1500) // Vote bin half width, wider than the USB jitter, under a third of the shortest period
+// Phase correction = error / 2^n, period correction = error / 2^(2n+1) for ~0.7 damping.
+// Loop bandwidth starts wide to pull in and narrows every PLL_GEAR_FRAMES packets
+#define PLL_GAIN_FAST      2
+#define PLL_GAIN_SLOW      5
+#define PLL_GEAR_FRAMES    16
+#define PLL_MIN_LEAD       20  // Closest a corrected frame start may be moved to now
+#define PLL_MAX_OUTLIERS   4   // Consecutive packets off by over a quarter frame before reacquiring
+
+typedef enum {
+	PLL_IDLE,
+	PLL_ACQUIRE, // Measuring the refresh period, frames follow packets directly
+	PLL_LOCKED   // Frames started by TIMER1_COMPC at the predicted display edge
+} PLL_State_t; // Free-run and the sync flywheel also pace frames with TIMER1_COMPC, from PLL_IDLE
+
+static volatile PLL_State_t pllState = PLL_IDLE;
+static uint16_t pllLastStamp;
+static uint16_t pllIntervals[_BV(PLL_ACQUIRE_SHIFT)]; // Packet intervals while acquiring
+static uint8_t pllCount;
+static uint8_t pllOutliers;
+static uint8_t pllGain; // Current phase correction shift
+static volatile uint32_t pllPeriod; // Display frame period
+static volatile uint32_t pllEdge; // Upcoming frame start, low 16 integer bits match OCR1C
+static volatile uint8_t pllEye; // Eye of the upcoming frame
+static uint32_t freerunPeriod; // Free-run frame period, same format as pllPeriod
+
+// Flywheel: once the frame rate is known, frames keep going at it for up to flywheelFrames
+// when sync edges or swap packets stop. Locked external sync arms TIMER1_COMPC at the next
+// predicted edge, the locked PLL runs on anyway; a frame the sync source should have been
+// due for counts as coasted. The source coming back inside the window just carries on,
+// otherwise it is followed from its second edge
+static volatile uint8_t flywheelFrames = FLYWHEEL_FRAMES;
+static volatile uint8_t coasted; // Frames in a row without the sync source
+
+// Combined mode eye announcements. A swap packet names the eye after the frame the display
+// started about eyeDelay before it came in, however long the host took. Queued with their
+// arrival times and matched to the frames sent by time, so one held up past the next edge
+// still sets the right eye instead of inverting the frame after. eyeDelay follows the
+// typical delay, until the first match it's half a period: the last frame before arrival.
+// Time alone can't tell a host that fell a whole frame behind from a driver that swapped
+// eyes: a frame left without a packet followed by one against the alternation is taken as
+// the former and eyeDelay moves a frame, two packets for one frame the other way round
+#define EYE_QUEUE_SIZE   4 // Power of two
+#define EYE_DELAY_SHIFT  4 // Swap packet delay averaged over about 2^n packets
+#define EYE_SLIP_CONFIRM 3 // Announcements in a row a frame off before eyeDelay moves
+#define EYE_SLIP_JITTER  6 // Slips are only told apart from jitter below 1/n of a period
+#define EYE_MAX_BEHIND   3 // Frames an announcement may trail the last one sent, older ones are dropped
+typedef struct
+{
+	uint32_t time; // IR_Time() it came in at
+	uint8_t eye;   // To follow the frame it belongs to
+} IR_EyeNote_t;
+static IR_EyeNote_t eyeQueue[EYE_QUEUE_SIZE];
+static volatile uint8_t eyeHead, eyeTail;
+static int32_t eyeDelay;
+static int32_t eyeJitter; // Average deviation from eyeDelay
+static bool eyeDelayKnown;
+static uint8_t eyeFrame; // frameCount of the frame the last announcement belonged to
+static int8_t eyeSlip; // Announcements in a row that looked a frame late, negative: early
+static uint8_t frameCount; // Frames started, wraps
+static uint32_t frameRef; // IR_Time() of the last frame's sync reference
+
+// Active protocol's lead in ticks, taken over with its schedule. With a lead, locked external
+// sync sends every frame from TIMER1_COMPC at the predicted edge less the lead, like the PLL
+// does, and the edges only correct the prediction
+static volatile int16_t frameLead;
+
+static uint16_t frameWindow; // Shutter open time between tokens, in ticks
+static volatile uint32_t syncPeriod; // Averaged sync edge interval, PERIOD_AVG_SHIFT fractional bits
+static uint16_t syncLastEdge; // Last edge taken, glitches don't count
+static volatile bool syncLocked;
+static uint8_t syncGlitches; // In a row
+static uint16_t syncDropped[SYNC_MAX_GLITCHES]; // Their times
+static uint16_t syncIntervals[SYNC_DETECT_EDGES];
+static volatile uint8_t syncCount; // Intervals collected, the main loop takes over once all are in
+static bool scheduleStale = false; // Protocol changed, schedule not rebuilt yet. Commands rebuild it at once, the tick retries
+
+/* Sync quality statistics */
+#define STAT_PERIOD_BIN0  (TICKS_PER_US * 1)
+#define STAT_LATENCY_BIN0 (TICKS_PER_US * 8)
+static IR_Stats_t irStats; // Updated from the ISRs, copied out with interrupts off
+static volatile uint16_t statPeriod; // Frame period for the interval histogram, 0 while unknown
+static uint16_t statLastStart;
+#if defined(SYNC_ICP) && !defined(IR_HW_PULSE)
+static volatile uint16_t frameSync; // Sync reference of the frame being sent
+static volatile bool statFirst; // First edge of the frame not sent yet, latency taken in its ISR
+#endif
+
+// Active protocol, the only one in SRAM: a built-in table copied from flash or a host
+// upload. Uploads are staged in protoImage while the cache stays in use, a commit parses
+// it over and the schedule double buffer switches at a frame
+#define EEPROM_LEADS       ((int16_t*)0x00) // Host set lead per built-in protocol, IR_PROTOCOL_COUNT of them
+#define EEPROM_LEADS_SET   ((uint8_t*)0x0E) // Bit per built-in protocol, cleared once its lead is stored
+#define EEPROM_PROTOCOL_ID ((uint8_t*)0x0F) // IR_ProtocolID_t to boot with
+#define EEPROM_PROTOCOL    ((uint8_t*)0x10) // Uploaded protocol: magic, length, image, checksum
+#define EEPROM_MAGIC       0x3E // Changes with the image layout
+
+static IR_Protocol_t protoCache = { .timings = { [IR_MAX_TIMINGS - 1] = 0 } }; // Sized by the initializer
+static uint8_t protoID = IR_PROTOCOL_UPLOADED;
+static uint8_t protoImage[IR_IMAGE_MAX];
+static uint8_t protoLength;
+static uint8_t protoChecksum;
+static bool storing = false;
+static bool storeLead; // Only the active protocol's lead, not the whole upload
+static uint8_t storeStep;
+
+// Protocols mixed in. Their tables stay in flash, BuildSchedule reads them a token at a time
+#ifdef IR_MIX
+static uint8_t mixIDs[IR_MIX_MAX];
+static int16_t mixLeads[IR_MIX_MAX]; // Each one's own, as it would be sent alone
+static uint8_t mixCount = 0;
+static uint16_t mixGap = IR_MIX_GAP * TICKS_PER_US;
+#else
+static const uint8_t mixCount = 0; // Mixing drops out of BuildSchedule at compile time
+static const uint16_t mixGap = IR_MIX_GAP * TICKS_PER_US;
+#endif
 
-static void SendToken(uint8_t token);
+// Token placed in the schedule being built, in schedule time
+typedef struct {
+	uint16_t start;
+	uint16_t end;
+	uint8_t edges;
+	uint8_t token; // Protocol index * 4 + token, the active protocol is 0
+} IR_Span_t;
+
+#ifdef EMITTER_TRACE
+// Active protocol's token boundaries within the schedule, for the trace: index of the
+// opening token's first and last edge, then the closing token's, 0xFF if there is none
+static uint8_t IR_ScheduleTokens[2][2][4]; // [buffer][eye]
+static const uint16_t* frameSchedule; // Schedule of the frame being sent
+static const uint8_t* frameTokens;
+static void TraceEdge(const uint16_t* edge);
+#define TRACE_EDGE(edge) TraceEdge(edge)
+#else
+#define TRACE_EDGE(edge) (void)(edge)
+#endif
+
+static void SyncTimeout(void);
+static Timer_Event_t syncTimer = { .handler = SyncTimeout };
+
+static bool BuildSchedule(uint16_t window, uint16_t period);
+static uint16_t FitToken(const IR_Span_t* spans, uint8_t count, uint16_t time, uint16_t length, uint16_t floor);
+static uint16_t ProtocolWindow(const IR_Protocol_t* protocol, uint16_t period);
+static void UpdateWindow(void);
+static void DetectRate(void);
+static uint8_t VotePeriod(const uint16_t* intervals, uint8_t count, uint16_t bin, uint32_t* bestSum);
+static bool SelectProtocol(uint8_t id);
+static int16_t StoredLead(uint8_t id, int16_t lead);
+static bool ValidateImage(uint8_t length);
+static void ApplyImage(uint8_t length);
+static bool LoadImage(void);
+static void LoadProtocol(void);
+static void StoreProtocol(void);
+static void StoreLead(void);
+static void SyncEdge(uint8_t level, uint16_t edge);
+static void PrepareFrame(uint8_t eye);
+static void StartFrame(uint16_t start, uint16_t edge);
+static uint16_t ArmFrame(const uint16_t* schedule, uint16_t start);
+static void PLL_Stop(void);
+static uint8_t StatBin(uint16_t value, uint16_t first);
+static void StatEye(uint8_t eye);
+static void MatchEyes(void);
 
 void IR_Init(void)
 {
 	/* GPIO */
 	bitSet(DDR_LED_EYE,    LED_EYE);
 	bitSet(DDR_LED_IR,     LED_IR);
+#ifdef IR_HW_PULSE
+	bitClear(PORT_LED_IR_OC, LED_IR_OC); // Level once compare output is disconnected
+	bitSet(DDR_LED_IR_OC,  LED_IR_OC);
+#endif
 	bitSet(DDRB, 5);
 	bitSet(PORTD, 5); // Force sync/output
 
-	/* TIMER1 - IR token and pulse timing*/
+	/* TIMER1 - IR token and pulse timing, free running reference clock */
 	TCCR1B = 0; // Timer stopped, normal mode
 	TCCR1A = 0;
-	TIMSK1 = 0; // All interrupts disabled
+	TIMSK1 = _BV(TOIE1); // Only the timebase overflow
 	TIFR1 = 0xFF; // Clear pending interrupt flags if any
+	START_IR_TIMER();
 
+	LoadProtocol();
+	BuildSchedule(FRAME_DURATION, 0); // Until the frame period is known
+	IR_SetFreerunRate(FREERUN_RATE);
 	IR_SetSyncMode(SYNCMODE_COMBINED);
 }
 
-void IR_Update(uint32_t curTime)
+void IR_Update(void)
 {
-	if (IR_SyncMode == SYNCMODE_FREERUN)
-	{
-		// Send without any sync source - good for testing glasses
-		uint16_t delta = curTime-lastFrame;
-		if (delta >= 9) // 111.(1)Hz
-		{
-			IR_SetEye(!curEye);
-			IR_StartFrame();
-		}
-	}
+	// Swap packets are handled from the USB interrupt, the flywheel stops predicted frames
+	// and syncTimer the emitter
+	UpdateWindow();
+	StoreProtocol();
+}
 
-	/* Update activity led */
+/* No frame for SYNC_TIMEOUT: the emitter goes idle. Runs from the tick interrupt */
+static void SyncTimeout(void)
+{
 	if (emitterActive)
 	{
-		if (!emitterActive_last) // just started
-		{
-			bitSet(PORT_LED_ACTIVE, LED_ACTIVE);
-			emitterActive_last = true;
-		}
-		else
-		{
-			if ((curTime-lastFrame) >= 200)
-			{
-				// Sync timeout
-				bitClear(PORT_LED_ACTIVE, LED_ACTIVE);
-				bitSet(PORT_LED_EYE, LED_EYE); // Active low
-				emitterActive = false;
-				emitterActive_last = false;
-			}
-		}
+		TRACE(TRACE_SYNC_TIMEOUT, 0);
+		irStats.timeouts++;
 	}
+	syncLocked = false; // Sync may come back at another rate
+	syncCount = 0;
+	eyeDelayKnown = false; // And so may the swap packets
+	eyeSlip = 0;
+	bitClear(PORT_LED_ACTIVE, LED_ACTIVE);
+	bitSet(PORT_LED_EYE, LED_EYE); // Active low
+	emitterActive = false;
 }
 
 void IR_SetSyncMode(SyncMode_t mode)
 {
+	uint_reg_t sreg = GetGlobalInterruptMask();
+#ifdef SYNC_ICP
+	GlobalInterruptDisable();
+	if (mode & SYNCMODE_EXTERNAL)
+	{
+		// Capture one edge at a time, starting with the one away from the current level
+		if (PIN_SYNCIN_ICP & _BV(SYNCIN_ICP))
+			TCCR1B = (TCCR1B & ~_BV(ICES1)) | _BV(ICNC1);
+		else
+			TCCR1B |= _BV(ICNC1) | _BV(ICES1);
+		TIFR1 = _BV(ICF1); // Edge select change may raise a false capture
+		bitSet(TIMSK1, ICIE1);
+	}
+	else
+	{
+		bitClear(TIMSK1, ICIE1);
+	}
+	SetGlobalInterruptMask(sreg);
+#else
 	if (mode & SYNCMODE_EXTERNAL)
 	{
 		EICRA |= (0 << ISC11) | (1 << ISC10); // any edge
@@ -87,9 +318,67 @@ void IR_SetSyncMode(SyncMode_t mode)
 		EICRA &= ~((0 << ISC11) | (1 << ISC10)); // any edge
 		bitClear(EIMSK, INT1);
 	}
+#endif
+	PLL_Stop();
 	synced = false;
 	emitterActive = false;
+	GlobalInterruptDisable();
+	// Swap packets are stamped with USB bus time, other modes don't need the SOF interrupt load
+	sofHeld = false; // A pulse ISR releasing it would turn SOF events back on
+	if (mode == SYNCMODE_DRIVER)
+		USB_Device_EnableSOFEvents();
+	else
+		USB_Device_DisableSOFEvents();
+	coasted = 0;
+	syncPeriod = 0;
+	syncLocked = false;
+	syncCount = 0;
+	eyeTail = eyeHead;
+	eyeDelayKnown = false;
+	eyeSlip = 0;
 	IR_SyncMode = mode;
+	SetGlobalInterruptMask(sreg);
+
+	if (mode == SYNCMODE_FREERUN)
+	{
+		// Send without any sync source - good for testing glasses. Paced by TIMER1_COMPC like
+		// the locked PLL, so frame starts don't depend on the main loop
+		GlobalInterruptDisable();
+		pllPeriod = freerunPeriod;
+		pllEdge = (uint32_t)(uint16_t)(TCNT1 + PLL_MIN_LEAD) << PLL_FRAC_BITS;
+		pllEye = !curEye;
+		PrepareFrame(pllEye);
+		OCR1C = pllEdge >> PLL_FRAC_BITS;
+		TIFR1 = _BV(OCF1C); // Clear stale match
+		bitSet(TIMSK1, OCIE1C);
+		SetGlobalInterruptMask(sreg);
+	}
+}
+
+/* Sets the free-run frame rate in mHz, e.g. 119880 for 119.88Hz. The period keeps
+   PLL_FRAC_BITS fractional ticks, so the phase accumulator on TIMER1_COMPC follows the
+   rate to a fraction of a ppm. A running free-run changes pace from the next frame */
+IR_UploadStatus_t IR_SetFreerunRate(uint32_t rate)
+{
+	const uint32_t second = TICKS_PER_US * 1000000000UL; // Ticks in 1000s, per mHz
+	if ((rate < (second / PERIOD_MAX)) || (rate > (second / PERIOD_MIN)))
+		return IR_UPLOAD_INVALID;
+
+	// Whole ticks first, the remainder is below the rate so its fraction fits 32 bits
+	uint32_t period = ((second / rate) << PLL_FRAC_BITS) + (((second % rate) << PLL_FRAC_BITS) / rate);
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	freerunPeriod = period;
+	if (IR_SyncMode == SYNCMODE_FREERUN)
+		pllPeriod = period;
+	SetGlobalInterruptMask(sreg);
+	return IR_UPLOAD_OK;
+}
+
+/* Sets how many predicted frames go out across a sync dropout, 0 stops frames with the source */
+void IR_SetFlywheel(uint8_t frames)
+{
+	flywheelFrames = frames;
 }
 
 void IR_SwapEyes(uint8_t swap)
@@ -97,100 +386,1283 @@ void IR_SwapEyes(uint8_t swap)
 	swapEyes = swap != 0;
 }
 
+/* Combined mode swap packet, eye is the one to show next. Queued for MatchEyes(), with
+   POLSEL low the sync level has the say. Runs in USB_COM_vect with interrupts enabled */
 void IR_SetEye(uint8_t eye)
 {
-	nextEye = eye ^ swapEyes;
+	uint32_t now = IR_Time();
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	if ((uint8_t)(eyeHead - eyeTail) == EYE_QUEUE_SIZE)
+		eyeTail++; // Oldest one gives way
+	IR_EyeNote_t* note = &eyeQueue[eyeHead++ & (EYE_QUEUE_SIZE - 1)];
+	note->time = now;
+	note->eye = eye ^ swapEyes;
+	if ((PIN_POLSEL & _BV(POLSEL)) == 0)
+		eyeTail = eyeHead;
 	synced = true;
+	SetGlobalInterruptMask(sreg);
+	MatchEyes();
 }
 void IR_StartFrame(void)
 {
-	emitterActive = true;
-	curEye = nextEye;
-	lastFrame = millis();
-	synced = false;
-	SendToken(curEye * 2);
+	uint16_t now = IR_Timestamp();
+	StartFrame(now, now);
 }
 //void IR_EndFrame(void) {}
 
+/* Atomic read of the 32-bit timebase, wraps after about 36 minutes */
+uint32_t IR_Time(void)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	uint16_t low = TCNT1;
+	uint16_t high = timeHigh;
+	if ((TIFR1 & _BV(TOV1)) && (low < 0x8000)) // Overflowed, interrupt not serviced yet
+		high++;
+	SetGlobalInterruptMask(sreg);
+	return ((uint32_t)high << 16) | low;
+}
+
+uint16_t IR_Timestamp(void)
+{
+	// 16-bit timer access goes through the shared TEMP register
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	uint16_t now = TCNT1;
+	SetGlobalInterruptMask(sreg);
+	return now;
+}
 
-static void SendToken(uint8_t token)
+/* Driver swap packet, eye is the one to show next and stamp the Timer1 time
+   of the USB frame it came in. Packets arrive with however much host jitter,
+   so once the refresh period is known they only correct the predicted phase
+   and eye polarity. Runs in USB_COM_vect with interrupts enabled */
+void IR_DriverSync(uint8_t eye, uint16_t stamp)
 {
-	if (IR_CurProtocol->sizes[token] == 0) // Check if token exists
+	eye ^= swapEyes;
+	uint16_t interval = stamp - pllLastStamp;
+	pllLastStamp = stamp;
+
+	if (pllState != PLL_LOCKED)
+	{
+		if ((pllState == PLL_IDLE) || (interval < PERIOD_MIN) || (interval > PERIOD_MAX))
+		{
+			// (Re)start measuring, a packet was lost or came in twice
+			pllState = PLL_ACQUIRE;
+			pllCount = 0;
+		}
+		else
+		{
+			pllIntervals[pllCount++] = interval;
+		}
+
+		// Follow the packets directly until the period is known. The packet names the eye of
+		// the frame after the one it came in, which is starting now
+		StatEye(!eye);
+		PrepareFrame(!eye);
+		uint16_t now = IR_Timestamp();
+		StartFrame(now, now);
+
+		uint32_t sum;
+		uint8_t votes = 0;
+		if (pllCount == _BV(PLL_ACQUIRE_SHIFT))
+		{
+			// A lost or doubled packet gives one long or two odd intervals, outvoted by the rest
+			votes = VotePeriod(pllIntervals, pllCount, PLL_ACQUIRE_BIN, &sum);
+			pllCount = 0;
+		}
+		if (votes > (_BV(PLL_ACQUIRE_SHIFT) / 2))
+		{
+			uint_reg_t sreg = GetGlobalInterruptMask();
+			GlobalInterruptDisable();
+			pllPeriod = (sum << PLL_FRAC_BITS) / votes;
+			pllEdge = ((uint32_t)stamp << PLL_FRAC_BITS) + pllPeriod;
+			pllEye = eye;
+			PrepareFrame(pllEye);
+			OCR1C = (pllEdge >> PLL_FRAC_BITS) - frameLead;
+			TIFR1 = _BV(OCF1C); // Clear stale match
+			bitSet(TIMSK1, OCIE1C);
+			SetGlobalInterruptMask(sreg);
+			pllOutliers = 0;
+			pllCount = 0;
+			coasted = 0;
+			pllGain = PLL_GAIN_FAST;
+			pllState = PLL_LOCKED;
+		}
 		return;
-	curToken = token;
+	}
 
-	curPulse = IR_CurProtocol->indices[token]; // Get timing array start index
-	lastPulse = curPulse + IR_CurProtocol->sizes[token];
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
 
-	bitClear(PORT_LED_IR, LED_IR);
-	TCNT1 = 0;
-	OCR1A = FRAME_PAN; // Token pan/delay
-	//OCR1B = 0x00FF;
-	bitSet(TIMSK1, OCIE1A); // Enable rising edge interrupt
-	//TIFR1 = 0xFF; // Clear pending interrupts if any
-	START_IR_TIMER();
+	// Phase error against the closer of the last and the upcoming predicted edge. With a
+	// lead the last frame went out before its edge, the stamp may still be short of it
+	uint16_t period = pllPeriod >> PLL_FRAC_BITS;
+	uint16_t last = (pllEdge - pllPeriod) >> PLL_FRAC_BITS;
+	if (interval > (period + period / 2))
+		irStats.missed++;
+	int32_t error = (int32_t)(uint16_t)(stamp - last + period / 2) - period / 2;
+	bool early = error > (period / 2);
+	if (early) // Packet belongs to the upcoming frame
+		error -= period;
+
+	if ((error > (period / 4)) || (error < -(int32_t)(period / 4)))
+	{
+		SetGlobalInterruptMask(sreg);
+		if (++pllOutliers >= PLL_MAX_OUTLIERS)
+		{
+			PLL_Stop(); // Lost lock, measure again
+			pllState = PLL_ACQUIRE;
+		}
+		return;
+	}
+	pllOutliers = 0;
+	synced = true; // Packet for the last or the upcoming frame, counted at the next one
+
+	pllEdge += error * (1L << (PLL_FRAC_BITS - pllGain));
+	pllPeriod += error * (1L << (PLL_FRAC_BITS - (2 * pllGain + 1)));
+	if (eye == (early ? pllEye : !pllEye))
+		irStats.eyeFixes++;
+	pllEye = early ? !eye : eye;
+	if (pllEye != armedEye)
+		PrepareFrame(pllEye);
+
+	uint16_t target = (pllEdge >> PLL_FRAC_BITS) - frameLead;
+	uint16_t fired = last - frameLead; // Last frame start
+	if ((uint16_t)(target - fired) < (uint16_t)(TCNT1 - fired + PLL_MIN_LEAD))
+	{
+		// Correction would move the frame start into the past
+		target = TCNT1 + PLL_MIN_LEAD;
+		pllEdge = (uint32_t)(uint16_t)(target + frameLead) << PLL_FRAC_BITS;
+	}
+	OCR1C = target;
+	SetGlobalInterruptMask(sreg);
+
+	if ((pllGain < PLL_GAIN_SLOW) && (++pllCount == PLL_GEAR_FRAMES))
+	{
+		pllGain++;
+		pllCount = 0;
+	}
+}
+
+static void PLL_Stop(void)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	bitClear(TIMSK1, OCIE1C);
+	SetGlobalInterruptMask(sreg);
+	pllState = PLL_IDLE;
+}
+
+/* Prepares the frame for eye as the next one to start. Interrupts may be on */
+static void PrepareFrame(uint8_t eye)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	const uint16_t* schedule = activeSchedule[eye];
+	armedSchedule = schedule[0] ? schedule : NULL; // Check if token exists
+	armedEye = eye;
+#ifdef EMITTER_TRACE
+	armedTokens = IR_ScheduleTokens[activeSchedule == IR_Schedule[1]][eye];
+#endif
+	SetGlobalInterruptMask(sreg);
+}
+
+/* Starts the prepared frame at start, edge is the sync reference it belongs to: start plus
+   the lead. The timer is armed first, the bookkeeping follows once the first edge is settled */
+static void StartFrame(uint16_t start, uint16_t edge)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	const uint16_t* schedule = armedSchedule;
+	uint16_t first = 0;
+	if (schedule)
+		first = ArmFrame(schedule, start);
+	curEye = armedEye;
+#ifdef EMITTER_TRACE
+	frameSchedule = schedule;
+	frameTokens = armedTokens;
+#endif
+	SetGlobalInterruptMask(sreg);
+	TRACE(TRACE_FRAME_START | curEye, start);
+
+	uint16_t period = statPeriod;
+	if (emitterActive && period)
+	{
+		uint16_t interval = start - statLastStart;
+		if (interval < (period + period / 2)) // Otherwise counted as missed
+			irStats.period[StatBin((interval > period) ? (interval - period) : (period - interval), STAT_PERIOD_BIN0)]++;
+	}
+	statLastStart = start;
+
+	if (!emitterActive)
+		bitSet(PORT_LED_ACTIVE, LED_ACTIVE);
+	emitterActive = true;
+	irStats.frames[curEye]++;
+	Timer_Start(&syncTimer, TIMER_MS(SYNC_TIMEOUT));
+	uint32_t now = IR_Time();
+	frameRef = now + (int16_t)(edge - (uint16_t)now); // May be ahead of now with a lead
+	frameCount++;
+	synced = false;
+	PrepareFrame(!curEye); // Frames alternate unless the sync source says otherwise
+	if (eyeTail != eyeHead) // Swap packet ahead of its frame
+		MatchEyes();
+	if (!schedule)
+		return;
+
+	int16_t late = (uint16_t)(first - start) - schedule[0];
+	if (late > 0) // Other interrupts held up the caller, the whole frame moved
+	{
+		TRACE(TRACE_FRAME_LATE, late);
+		irStats.late++;
+	}
+#if !defined(SYNC_ICP) || defined(IR_HW_PULSE)
+	irStats.latency[StatBin(first - start, STAT_LATENCY_BIN0)]++;
+#endif
+#ifndef SYNC_ICP
+#ifdef EMITTER_TRACE
+	if (frameTokens[0] == 0) // Sent from here, not from a compare
+		TRACE(TRACE_TOKEN_START | (curEye * 2), first);
+#endif
+#endif
 
 	// Light up only between frames - invisible(ideally) with glasses
 	bitSet(PORT_LED_EYE, LED_EYE); // Active low
 }
 
-ISR(TIMER1_COMPA_vect) // IR pulse rising edge
+
+/* Tracks the display frame period and resizes the shutter open window to the
+   current protocol's share of it */
+static void UpdateWindow(void)
 {
-	bitSet(PORT_LED_IR, LED_IR);
-	
-	OCR1B = OCR1A + (IR_CurProtocol->timings[curPulse++] * 2); // Pulse duration
-	bitSet(TIMSK1, OCIE1B); // Enable falling edge interrupt
-	bitClear(TIMSK1, OCIE1A); // Disable this interrupt
+	uint16_t period;
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	bool locked = (pllState == PLL_LOCKED);
+	uint32_t pllNow = pllPeriod; // Tracked from the USB interrupt
+	SetGlobalInterruptMask(sreg);
+	if (locked || (IR_SyncMode == SYNCMODE_FREERUN))
+	{
+		period = pllNow >> PLL_FRAC_BITS;
+	}
+	else
+	{
+		DetectRate();
+		GlobalInterruptDisable();
+		period = syncPeriod >> PERIOD_AVG_SHIFT; // Averaged by the sync edge ISR, kept while detecting again
+		SetGlobalInterruptMask(sreg);
+	}
+	if (period != statPeriod)
+	{
+		GlobalInterruptDisable();
+		statPeriod = period;
+		SetGlobalInterruptMask(sreg);
+	}
+
+	uint16_t window = frameWindow;
+	if (period != 0) // Otherwise keep the last window until the rate is known
+		window = ProtocolWindow(&protoCache, period);
+	if (scheduleStale || (window > (frameWindow + IR_WINDOW_STEP)) || ((window + IR_WINDOW_STEP) < frameWindow))
+		scheduleStale = !BuildSchedule(window, period);
 }
-ISR(TIMER1_COMPB_vect) // IR pulse falling edge
+
+/* Each interval is the centre of a histogram bin bin ticks either way, returns how many of
+   them the fullest bin holds and their sum */
+static uint8_t VotePeriod(const uint16_t* intervals, uint8_t count, uint16_t bin, uint32_t* bestSum)
 {
-	bitClear(PORT_LED_IR, LED_IR);
+	uint8_t best = 0;
+	*bestSum = 0;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		uint8_t votes = 0;
+		uint32_t sum = 0;
+		for (uint8_t j = 0; j < count; j++)
+		{
+			uint16_t distance = (intervals[j] > intervals[i]) ?
+				(intervals[j] - intervals[i]) : (intervals[i] - intervals[j]);
+			if (distance <= bin)
+			{
+				votes++;
+				sum += intervals[j];
+			}
+		}
+		if (votes > best)
+		{
+			best = votes;
+			*bestSum = sum;
+		}
+	}
+	return best;
+}
+
+/* Locks external sync to the refresh period once the sync edge ISR has collected
+   SYNC_DETECT_EDGES intervals: each one is the centre of a histogram bin, the bin
+   holding most of them is the period. Noise and lost edges only add a few short or
+   double intervals, without a majority it starts over */
+static void DetectRate(void)
+{
+	if (syncCount < SYNC_DETECT_EDGES) // Only written by the ISR until then
+		return;
+
+	uint32_t bestSum;
+	uint8_t best = VotePeriod(syncIntervals, SYNC_DETECT_EDGES, SYNC_DETECT_BIN, &bestSum);
 
-	if (curPulse == lastPulse) // Token finished
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	if (best > (SYNC_DETECT_EDGES / 2))
 	{
-		uint8_t nextsize;
-		bool hasnext = (curToken & 1) == 0; // end of shutter opening token
-		if (hasnext)
+		syncPeriod = (bestSum << PERIOD_AVG_SHIFT) / best;
+		syncGlitches = 0;
+		syncLocked = true;
+	}
+	syncCount = 0;
+	SetGlobalInterruptMask(sreg);
+}
+
+/* Shutter open time between the tokens of protocol at the given frame period */
+static uint16_t ProtocolWindow(const IR_Protocol_t* protocol, uint16_t period)
+{
+	uint16_t open = ((uint32_t)period * protocol->duty) >> 8;
+	uint16_t guard = protocol->guard * TICKS_PER_US;
+	if (open > (guard + IR_WINDOW_MIN))
+		return open - guard;
+	return IR_WINDOW_MIN;
+}
+
+/* Expands the current protocol and the mixed ones into compare values for both
+   eyes, so the pulse ISRs only have to load the next one. The active protocol's
+   tokens keep their place, mixed tokens are fitted around them and dropped if
+   there is no room. Fills the buffer not in use and hands it to the next frame,
+   fails while a frame still runs from that buffer. period is 0 while unknown */
+static bool BuildSchedule(uint16_t window, uint16_t period)
+{
+	uint16_t (*schedule)[IR_SCHEDULE_SIZE] = IR_Schedule[activeSchedule == IR_Schedule[0]];
+
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	const uint16_t* sending = nextEdge;
+	SetGlobalInterruptMask(sreg);
+	if ((sending >= schedule[0]) && (sending < schedule[2]))
+		return false; // Try again after the frame
+
+	// Mixed tokens have to be done before the next frame's first edge
+	uint16_t limit = ((period != 0) ? period : PERIOD_MIN) - mixGap;
+	// Frames start the largest lead ahead, protocols with less wait out the difference
+	int16_t lead = protoCache.lead;
+#ifdef IR_MIX
+	for (uint8_t i = 0; i < mixCount; i++)
+	{
+		if (mixLeads[i] > lead)
+			lead = mixLeads[i];
+	}
+#endif
+
+	for (uint8_t eye = 0; eye < 2; eye++)
+	{
+		IR_Span_t spans[2 * (IR_MIX_MAX + 1)]; // Sorted by time
+		uint8_t count = 0;
+		uint8_t edges = 0;
+
+		for (uint8_t mix = 0; mix <= mixCount; mix++)
 		{
-			nextsize = IR_CurProtocol->sizes[curToken+1];
-			hasnext = nextsize > 0; // closing token exists
+			const IR_Protocol_t* protocol = &protoCache;
+			uint16_t open = window;
+			int16_t own = protoCache.lead;
+#ifdef IR_MIX
+			IR_Protocol_t mixed; // Header only, the timings are copied a token at a time
+			const IR_Protocol_t* table = NULL;
+			if (mix > 0)
+			{
+				table = IR_ProtocolTable(mixIDs[mix - 1]);
+				memcpy_P(&mixed, table, sizeof(mixed));
+				protocol = &mixed;
+				own = mixLeads[mix - 1];
+				if (period != 0)
+					open = ProtocolWindow(protocol, period);
+			}
+#endif
+
+			uint16_t time = FRAME_PAN + (lead - own) * TICKS_PER_US; // Token pan/delay
+			uint16_t floor = 0; // Closing token can't be moved before the opening one
+			for (uint8_t token = eye * 2; token < (eye * 2 + 2); token++)
+			{
+				uint8_t size = protocol->sizes[token];
+				if ((size == 0) || (size > IR_MAX_TOKEN_SIZE)) // Check if token exists
+					break;
+				if ((edges + size + 1) >= IR_SCHEDULE_SIZE)
+					break;
+
+				const uint16_t* timing;
+#ifdef IR_MIX
+				uint16_t mixTiming[IR_MAX_TOKEN_SIZE];
+				if (table)
+				{
+					memcpy_P(mixTiming, &table->timings[mixed.indices[token]], size * sizeof(uint16_t));
+					timing = mixTiming;
+				}
+				else
+#endif
+					timing = &protocol->timings[protocol->indices[token]];
+				uint16_t length = 0;
+				for (uint8_t i = 0; i < size; i++)
+					length += timing[i] * 2;
+				uint16_t at = time;
+				if (mix > 0)
+				{
+					at = FitToken(spans, count, time, length, floor);
+					if ((uint16_t)(at + length) > limit)
+						break;
+				}
+
+				// Insert in time order, shifting the later tokens' edges up
+				uint8_t index = count;
+				uint8_t position = edges;
+				while ((index > 0) && (spans[index - 1].start > at))
+					position -= spans[--index].edges;
+				memmove(&spans[index + 1], &spans[index], (count - index) * sizeof(IR_Span_t));
+				spans[index] = (IR_Span_t){ at, at + length, size + 1, mix * 4 + token };
+				count++;
+				uint16_t* edge = schedule[eye] + position;
+				memmove(edge + size + 1, edge, (edges - position) * sizeof(uint16_t));
+				edges += size + 1;
+
+				*edge++ = at; // First rising edge
+				for (uint8_t i = 0; i < size; i++)
+				{
+					at += timing[i] * 2; // Pulse duration / time until next pulse
+					*edge++ = at;
+				}
+				floor = at + mixGap;
+				time += length + open; // Shutter open time until closing token
+			}
 		}
-		if (hasnext)
+		schedule[eye][edges] = 0; // Frame end
+
+#ifdef EMITTER_TRACE
+		uint8_t* tokens = IR_ScheduleTokens[schedule == IR_Schedule[1]][eye];
+		memset(tokens, 0xFF, 4);
+		for (uint8_t i = 0, position = 0; i < count; position += spans[i++].edges)
 		{
-			OCR1A = OCR1B + FRAME_DURATION;
-			bitSet(TIMSK1, OCIE1A); // Enable rising edge interrupt
-			curToken++;
-			curPulse = IR_CurProtocol->indices[curToken]; // Get timing array start index
-			lastPulse = curPulse + nextsize;
-			//bitSet(PORTB, 5); // Frame start debug
+			if (spans[i].token < 4)
+			{
+				tokens[(spans[i].token & 1) * 2] = position;
+				tokens[(spans[i].token & 1) * 2 + 1] = position + spans[i].edges - 1;
+			}
 		}
-		else
+#endif
+	}
+	sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	activeSchedule = schedule;
+	PrepareFrame(armedEye); // Prepared frame may point into the old buffer
+	frameLead = lead * TICKS_PER_US;
+	SetGlobalInterruptMask(sreg);
+	frameWindow = window;
+	return true;
+}
+
+/* Start time for a mixed protocol token of length ticks that belongs at time, clear
+   of the tokens in spans by the mix gap. Glasses decode a token from its pulse
+   spacing, so another protocol's pulse within it breaks it. Opening tokens move
+   later, closing tokens (floor set) earlier as long as they stay after floor: those
+   shutters then open late or close early rather than into the next frame */
+static uint16_t FitToken(const IR_Span_t* spans, uint8_t count, uint16_t time, uint16_t length, uint16_t floor)
+{
+	uint16_t gap = mixGap;
+	if (floor != 0)
+	{
+		uint16_t at = time;
+		for (uint8_t i = count; (i > 0) && (at >= floor); i--)
+		{
+			const IR_Span_t* span = &spans[i - 1];
+			if ((at < (span->end + gap)) && ((at + length + gap) > span->start))
+				at = (span->start > (length + gap)) ? (span->start - length - gap) : 0;
+		}
+		if (at >= floor)
+			return at;
+		if (time < floor)
+			time = floor;
+	}
+	for (uint8_t i = 0; i < count; i++)
+	{
+		if ((time < (spans[i].end + gap)) && ((time + length + gap) > spans[i].start))
+			time = spans[i].end + gap;
+	}
+	return time;
+}
+
+/* Host upload of a protocol image, in chunks of up to one packet */
+IR_UploadStatus_t IR_UploadProtocol(uint8_t offset, const uint8_t* data, uint8_t amount)
+{
+	if (storing) // Image buffer is the EEPROM write source
+		return IR_UPLOAD_BUSY;
+	if ((offset + amount) > IR_IMAGE_MAX)
+		return IR_UPLOAD_RANGE;
+	memcpy(protoImage + offset, data, amount);
+	return IR_UPLOAD_OK;
+}
+
+/* Switches to the uploaded image if it is a usable protocol, then stores it */
+IR_UploadStatus_t IR_CommitProtocol(uint8_t length)
+{
+	if (storing)
+		return IR_UPLOAD_BUSY;
+	if (!ValidateImage(length))
+		return IR_UPLOAD_INVALID;
+
+	ApplyImage(length);
+	protoChecksum = 0;
+	for (uint8_t i = 0; i < length; i++)
+		protoChecksum += protoImage[i];
+	storeLead = false;
+	storeStep = 0;
+	storing = true;
+	UpdateWindow();
+	return IR_UPLOAD_OK;
+}
+
+/* Switches to built-in protocol id and makes it the one to boot with */
+IR_UploadStatus_t IR_SelectProtocol(uint8_t id)
+{
+	if (storing)
+		return IR_UPLOAD_BUSY;
+	if (!SelectProtocol(id))
+		return IR_UPLOAD_INVALID;
+
+	storeLead = false;
+	storeStep = protoLength + 4; // Only the protocol ID
+	storing = true;
+	UpdateWindow();
+	return IR_UPLOAD_OK;
+}
+
+/* Sends built-in protocols ids alongside the active one from the next frame, count 0
+   stops mixing. gap is the clearance between tokens of different protocols in us, 0
+   for the default. Fails if the tokens can't all fit the schedule */
+IR_UploadStatus_t IR_MixProtocols(const uint8_t* ids, uint8_t count, uint8_t gap)
+{
+	if ((count > IR_MIX_MAX) || ((gap != 0) && (gap < IR_MIN_TIMING)))
+		return IR_UPLOAD_INVALID;
+#ifdef IR_MIX
+	uint8_t edges[2] = { 0, 0 };
+	int16_t leads[IR_MIX_MAX];
+	for (uint8_t mix = 0; mix <= count; mix++)
+	{
+		const uint8_t* sizes = protoCache.sizes;
+		uint8_t mixSizes[4];
+		if (mix > 0)
 		{
-			//bitClear(PORTB, 5); // Frame end debug
-			STOP_IR_TIMER();
-			bitClear(PORT_LED_EYE, LED_EYE); // Active low
+			for (uint8_t i = 0; i < (mix - 1); i++)
+			{
+				if (ids[i] == ids[mix - 1])
+					return IR_UPLOAD_INVALID;
+			}
+			const IR_Protocol_t* table = IR_ProtocolTable(ids[mix - 1]);
+			if ((ids[mix - 1] == protoID) || !table)
+				return IR_UPLOAD_INVALID;
+			memcpy_P(mixSizes, table->sizes, sizeof(mixSizes));
+			sizes = mixSizes;
+			leads[mix - 1] = StoredLead(ids[mix - 1], (int16_t)pgm_read_word(&table->lead));
+		}
+		for (uint8_t token = 0; token < 4; token++)
+		{
+			if (sizes[token])
+				edges[token / 2] += sizes[token] + 1;
+		}
+	}
+	if ((edges[0] >= IR_SCHEDULE_SIZE) || (edges[1] >= IR_SCHEDULE_SIZE))
+		return IR_UPLOAD_INVALID;
+
+	memcpy(mixIDs, ids, count);
+	memcpy(mixLeads, leads, count * sizeof(int16_t));
+	mixCount = count;
+	mixGap = (gap ? gap : IR_MIX_GAP) * TICKS_PER_US;
+	scheduleStale = true;
+	UpdateWindow();
+#endif
+	return IR_UPLOAD_OK;
+}
+
+/* Moves the active protocol's opening token lead us ahead of the predicted frame edge, after
+   it if negative, from the next schedule. Stored for the protocol: selecting it again, mixing
+   it in or the next power up brings it back */
+IR_UploadStatus_t IR_SetProtocolLead(int16_t lead)
+{
+	if (storing)
+		return IR_UPLOAD_BUSY;
+	if ((lead > IR_LEAD_MAX) || (lead < -IR_LEAD_MAX))
+		return IR_UPLOAD_INVALID;
+
+	if (protoID == IR_PROTOCOL_UPLOADED) // Goes into the stored image
+		protoChecksum += (uint8_t)lead + (uint8_t)(lead >> 8) - (uint8_t)protoCache.lead - (uint8_t)(protoCache.lead >> 8);
+	protoCache.lead = lead;
+	scheduleStale = true;
+	storeLead = true;
+	storeStep = 0;
+	storing = true;
+	UpdateWindow();
+	return IR_UPLOAD_OK;
+}
+
+bool IR_ProtocolStoring(void)
+{
+	return storing;
+}
+
+void IR_GetStats(IR_Stats_t* stats)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	memcpy(stats, &irStats, sizeof(*stats));
+	stats->framePeriod = statPeriod;
+	SetGlobalInterruptMask(sreg);
+	stats->window = frameWindow;
+}
+
+/* Histogram bin of value: bin 0 is below first, each further bin twice as wide,
+   the last one open ended */
+static uint8_t StatBin(uint16_t value, uint16_t first)
+{
+	uint8_t bin = 0;
+	while ((value >= first) && (bin < (IR_STATS_BINS - 1)))
+	{
+		first <<= 1;
+		bin++;
+	}
+	return bin;
+}
+
+/* Counts an eye polarity correction, eye is the one the sync source wants next */
+static void StatEye(uint8_t eye)
+{
+	if (emitterActive && (eye == curEye))
+	{
+		uint_reg_t sreg = GetGlobalInterruptMask();
+		GlobalInterruptDisable(); // Also counted from the sync edge ISR
+		irStats.eyeFixes++;
+		SetGlobalInterruptMask(sreg);
+	}
+}
+
+/* Sets the next frame's eye from the queued swap packets. Each belongs to the frame whose
+   sync reference is closest to its arrival less eyeDelay: the eye it names follows that
+   frame, later ones alternate from there. One for a frame not sent yet stays queued until
+   it is, without a frame period the eye goes to the next frame as it comes. Interrupts may be on */
+static void MatchEyes(void)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	uint16_t period = statPeriod;
+	while (eyeTail != eyeHead)
+	{
+		const IR_EyeNote_t* note = &eyeQueue[eyeTail & (EYE_QUEUE_SIZE - 1)];
+		int8_t behind = 0; // Frames its one trails the last one sent, -1 = the next one
+		if (period && emitterActive)
+		{
+			int32_t delay = eyeDelayKnown ? eyeDelay : (period / 2);
+			int32_t offset = (int32_t)(frameRef - note->time) + delay + (period / 2);
+			if (offset < -(int32_t)period)
+				break; // Frame after the next one
+			if (offset < 0)
+				behind = -1;
+			while ((offset >= period) && (behind <= EYE_MAX_BEHIND))
+			{
+				offset -= period;
+				behind++;
+			}
+			if (behind > EYE_MAX_BEHIND)
+			{
+				eyeTail++;
+				continue;
+			}
+
+			int8_t slip = 0;
+			if (eyeDelayKnown && (eyeJitter < (period / EYE_SLIP_JITTER)) && ((note->eye ^ (behind & 1)) != armedEye))
+			{
+				uint8_t skipped = frameCount - behind - eyeFrame;
+				if ((skipped == 2) && (eyeDelay < (int32_t)(EYE_MAX_BEHIND - 1) * period))
+					slip = 1; // Host fell a frame behind
+				else if ((skipped == 0) && (eyeDelay >= period))
+					slip = -1; // And caught up
+			}
+			if (slip)
+			{
+				// Could be jitter across the frame boundary until EYE_SLIP_CONFIRM in a row agree
+				behind += slip;
+				if ((eyeSlip ^ slip) >= 0) // Same direction
+					slip += eyeSlip;
+				if ((slip >= EYE_SLIP_CONFIRM) || (slip <= -EYE_SLIP_CONFIRM))
+				{
+					eyeDelay += (slip > 0) ? (int32_t)period : -(int32_t)period;
+					irStats.eyeSlips++;
+					slip = 0;
+				}
+			}
+			else
+			{
+				int32_t measured = (int32_t)(note->time - frameRef) + (int32_t)behind * period;
+				if (!eyeDelayKnown)
+				{
+					eyeDelay = measured;
+					eyeJitter = period / EYE_SLIP_JITTER; // Not trusted until it settles
+				}
+				int32_t deviation = measured - eyeDelay;
+				eyeDelay += deviation >> EYE_DELAY_SHIFT;
+				eyeJitter += (((deviation < 0) ? -deviation : deviation) - eyeJitter) >> EYE_DELAY_SHIFT;
+				eyeDelayKnown = true;
+			}
+			eyeSlip = slip;
+			eyeFrame = frameCount - behind;
+		}
+		uint8_t eye = note->eye ^ (behind & 1);
+		eyeTail++;
+		if (eye != armedEye)
+		{
+			if (emitterActive)
+				irStats.eyeFixes++; // Driver swapped eyes
+			PrepareFrame(eye);
 		}
 	}
+	SetGlobalInterruptMask(sreg);
+}
+
+uint8_t IR_ProtocolID(void)
+{
+	return protoID;
+}
+
+static bool SelectProtocol(uint8_t id)
+{
+	if (!IR_ReadProtocol(id, &protoCache, IR_MAX_TIMINGS))
+		return false;
+	protoCache.lead = StoredLead(id, protoCache.lead);
+	protoID = id;
+	scheduleStale = true;
+	return true;
+}
+
+/* Lead of built-in protocol id: the host's once one is stored, otherwise lead from its table */
+static int16_t StoredLead(uint8_t id, int16_t lead)
+{
+	if (eeprom_read_byte(EEPROM_LEADS_SET) & _BV(id))
+		return lead;
+	int16_t stored;
+	eeprom_read_block(&stored, &EEPROM_LEADS[id], sizeof(stored));
+	if ((stored > IR_LEAD_MAX) || (stored < -IR_LEAD_MAX))
+		return lead;
+	return stored;
+}
+
+static uint16_t ImageWord(uint8_t index)
+{
+	return protoImage[index] | (protoImage[index + 1] << 8);
+}
+
+/* Checks that every token fits the schedule, stays within the timings and
+   leaves room for the open window even at the fastest refresh */
+static bool ValidateImage(uint8_t length)
+{
+	if ((length < (IR_IMAGE_HEADER + 2)) || (length > IR_IMAGE_MAX) || ((length - IR_IMAGE_HEADER) & 1))
+		return false;
+	uint8_t count = (length - IR_IMAGE_HEADER) / 2;
+	const uint8_t* sizes = protoImage;
+	const uint8_t* indices = protoImage + 4;
+
+	if ((sizes[0] == 0) || (protoImage[8] == 0)) // Right eye opening token and a duty are required
+		return false;
+	int16_t lead = ImageWord(11);
+	if ((lead > IR_LEAD_MAX) || (lead < -IR_LEAD_MAX))
+		return false;
+	for (uint8_t eye = 0; eye < 2; eye++)
+	{
+		uint32_t time = FRAME_PAN;
+		for (uint8_t token = eye * 2; token < (eye * 2 + 2); token++)
+		{
+			uint8_t size = sizes[token];
+			if (size == 0)
+				continue;
+			if ((size > IR_MAX_TOKEN_SIZE) || !(size & 1) || ((indices[token] + size) > count))
+				return false; // Tokens also have to end with a pulse
+			if ((token & 1) && (sizes[token - 1] == 0)) // Closing token without opening one
+				return false;
+
+			for (uint8_t i = 0; i < size; i++)
+			{
+				uint16_t timing = ImageWord(IR_IMAGE_HEADER + 2 * (indices[token] + i));
+				if (timing < IR_MIN_TIMING)
+					return false;
+				time += timing * TICKS_PER_US;
+			}
+		}
+		if (time > (PERIOD_MIN / 2))
+			return false;
+	}
+	return true;
+}
+
+/* Makes a validated image the current protocol, the schedule follows from the next frame */
+static void ApplyImage(uint8_t length)
+{
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		protoCache.sizes[i] = protoImage[i];
+		protoCache.indices[i] = protoImage[4 + i];
+	}
+	protoCache.duty = protoImage[8];
+	protoCache.guard = ImageWord(9);
+	protoCache.lead = ImageWord(11);
+	for (uint8_t i = 0; i < ((length - IR_IMAGE_HEADER) / 2); i++)
+		protoCache.timings[i] = ImageWord(IR_IMAGE_HEADER + 2 * i);
+
+	protoLength = length;
+	protoID = IR_PROTOCOL_UPLOADED;
+	scheduleStale = true;
+}
+
+/* Protocol selected or uploaded before power down, the built-in default otherwise */
+static void LoadProtocol(void)
+{
+	uint8_t id = eeprom_read_byte(EEPROM_PROTOCOL_ID);
+	if ((id == IR_PROTOCOL_UPLOADED) && LoadImage())
+		return;
+	if (!SelectProtocol(id))
+		SelectProtocol(IR_PROTOCOL_DEFAULT);
+}
+
+static bool LoadImage(void)
+{
+	const uint8_t* base = EEPROM_PROTOCOL;
+	if (eeprom_read_byte(base) != EEPROM_MAGIC)
+		return false;
+	uint8_t length = eeprom_read_byte(base + 1);
+	if (length > IR_IMAGE_MAX)
+		return false;
+	eeprom_read_block(protoImage, base + 2, length);
+
+	uint8_t checksum = 0;
+	for (uint8_t i = 0; i < length; i++)
+		checksum += protoImage[i];
+	if ((checksum != eeprom_read_byte(base + 2 + length)) || !ValidateImage(length))
+		return false;
+	ApplyImage(length);
+	protoChecksum = checksum; // Kept up to date by IR_SetProtocolLead
+	return true;
+}
+
+/* Writes the current upload, then the protocol ID to EEPROM one byte per call, so
+   the main loop never waits for the EEPROM. The magic and the ID go last to leave
+   torn copies unused */
+static void StoreProtocol(void)
+{
+	if (!storing || !eeprom_is_ready())
+		return;
+	if (storeLead)
+	{
+		StoreLead();
+		return;
+	}
+
+	uint8_t step = storeStep++;
+	uint8_t* address = EEPROM_PROTOCOL + step;
+	uint8_t value;
+	if (step == 0)
+		value = 0xFF; // Invalidate the old copy first
+	else if (step == 1)
+		value = protoLength;
+	else if (step < (protoLength + 2))
+		value = protoImage[step - 2];
+	else if (step == (protoLength + 2))
+		value = protoChecksum;
+	else if (step == (protoLength + 3))
+	{
+		address = EEPROM_PROTOCOL;
+		value = EEPROM_MAGIC;
+	}
 	else
 	{
-		OCR1A = OCR1B + (IR_CurProtocol->timings[curPulse++] * 2);  // Time until next pulse
-		bitSet(TIMSK1, OCIE1A); // Enable rising edge interrupt
+		address = EEPROM_PROTOCOL_ID;
+		value = protoID;
+		storing = false;
 	}
-	bitClear(TIMSK1, OCIE1B); // Disable this interrupt
+	eeprom_update_byte(address, value);
 }
 
-// Frame sync edge
-ISR (INT1_vect)
+/* Writes the lead just set for the active protocol, one byte per call. A built-in's goes to
+   EEPROM_LEADS and is marked stored last, an upload's into its stored image, which is left
+   invalid until the checksum matches again */
+static void StoreLead(void)
+{
+	uint8_t step = storeStep++;
+	uint16_t lead = protoCache.lead;
+	uint8_t* address;
+	uint8_t value;
+	if (protoID != IR_PROTOCOL_UPLOADED)
+	{
+		address = (uint8_t*)&EEPROM_LEADS[protoID] + step;
+		value = (step == 0) ? (lead & 0xFF) : (lead >> 8);
+		if (step == 2)
+		{
+			address = EEPROM_LEADS_SET;
+			value = eeprom_read_byte(EEPROM_LEADS_SET) & ~_BV(protoID);
+			storing = false;
+		}
+	}
+	else
+	{
+		address = EEPROM_PROTOCOL;
+		value = 0xFF; // Invalidate the image first
+		if ((step == 1) || (step == 2))
+		{
+			address = EEPROM_PROTOCOL + 2 + 11 + (step - 1); // Image lead
+			value = (step == 1) ? (lead & 0xFF) : (lead >> 8);
+		}
+		else if (step == 3)
+		{
+			address = EEPROM_PROTOCOL + 2 + protoLength;
+			value = protoChecksum;
+		}
+		else if (step == 4)
+		{
+			value = EEPROM_MAGIC;
+			storing = false;
+		}
+	}
+	eeprom_update_byte(address, value);
+}
+
+#ifndef IR_HW_PULSE
+/* The SOF handler runs longer than a software pulse edge may slip. An edge about to be
+   armed for at that falls in the next SOF's shadow holds its interrupt off, the edge's
+   own ISR lets it go with ReleaseSof(). The SOF handler stamps the predicted time then */
+static inline void HoldSof(uint16_t at)
+{
+	if (bit_is_set(UDIEN, SOFE) &&
+	    ((uint16_t)(at - (sofStamp + SOF_TICKS - SOF_SHADOW_PRE)) < (SOF_SHADOW_PRE + SOF_SHADOW_POST)))
+	{
+		bitClear(UDIEN, SOFE);
+		sofHeld = true;
+	}
+}
+
+static inline void ReleaseSof(void)
+{
+	if (sofHeld)
+		bitSet(UDIEN, SOFE);
+}
+#endif
+
+/* Sends the first edge of schedule or arms the timer for it, with interrupts off.
+   Without SYNC_ICP the edge goes out right away: the sync reference is now or just
+   past. A mixed token waiting out its protocol's smaller lead ahead of the first one is
+   armed for from now instead. With SYNC_ICP the edge follows the captured time by
+   its schedule time exactly, unless the capture was serviced too late. Returns the
+   Timer1 time of the first edge */
+static uint16_t ArmFrame(const uint16_t* schedule, uint16_t start)
+{
+#ifdef SYNC_ICP
+#ifndef IR_HW_PULSE
+	frameSync = start;
+#endif
+	uint16_t late = TCNT1 - start;
+	if ((late + IR_MIN_LEAD) > schedule[0])
+		start += late + IR_MIN_LEAD - schedule[0]; // Shift the whole frame rather than lose it
+#else
+	if ((uint16_t)(schedule[0] - FRAME_PAN) <= IR_MIN_LEAD)
+	{
+#ifdef IR_HW_PULSE
+		TCCR1A = COM_IR_SET;
+		TCCR1C = _BV(FOC_IR); // First edge
+		uint16_t first = TCNT1;
+		start = first - schedule[0];
+		OCR_IR = start + schedule[1];
+		TCCR1A = COM_IR_CLEAR; // Then alternate from the end of the first pulse
+		TIFR1 = _BV(OCF_IR); // Clear stale match
+		bitSet(TIMSK1, OCIE_IR);
+#else
+		bitSet(PORT_LED_IR, LED_IR); // First edge
+		uint16_t first = TCNT1;
+		start = first - IR_ISR_ENTRY - schedule[0]; // Later edges come from compare ISRs, as late as their entry
+		HoldSof(start + schedule[1]);
+		OCR1B = start + schedule[1];
+		TIFR1 = _BV(OCF1B); // Clear stale match
+		TIMSK1 = (TIMSK1 & ~_BV(OCIE1A)) | _BV(OCIE1B); // Falling edge interrupt takes over
+#endif
+		nextEdge = schedule + 2;
+		frameStart = start;
+		return first;
+	}
+	start = TCNT1 - FRAME_PAN;
+#endif
+	uint16_t first = start + schedule[0];
+	nextEdge = schedule + 1;
+#ifdef IR_HW_PULSE
+	// The compare output hardware sets the first edge on time
+	TCCR1A = COM_IR_CLEAR;
+	TCCR1C = _BV(FOC_IR); // Force the output low in case a frame was cut short
+	TCCR1A = COM_IR_SET;  // First edge is rising
+	OCR_IR = first;
+	TIFR1 = _BV(OCF_IR); // Clear stale match
+	bitSet(TIMSK1, OCIE_IR);
+#else
+	bitClear(PORT_LED_IR, LED_IR);
+#ifdef SYNC_ICP
+	statFirst = true;
+#endif
+	HoldSof(first);
+	OCR1A = first;
+	TIFR1 = _BV(OCF1A); // Clear stale match
+	TIMSK1 = (TIMSK1 & ~_BV(OCIE1B)) | _BV(OCIE1A); // Enable rising edge interrupt only
+#endif
+	frameStart = start;
+	return first;
+}
+
+#ifdef EMITTER_TRACE
+/* Token start/end for the trace, edge is the schedule entry that just matched */
+static void TraceEdge(const uint16_t* edge)
+{
+	uint8_t index = edge - frameSchedule;
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		if (index == frameTokens[i]) // Mixed protocols' tokens aren't traced
+		{
+			TRACE(((i & 1) ? TRACE_TOKEN_END : TRACE_TOKEN_START) | (curEye * 2 + i / 2), frameStart + *edge);
+			break;
+		}
+	}
+}
+#endif
+
+#ifdef IR_HW_PULSE
+ISR(IR_OC_vect) // IR pulse edge, already driven by the compare output
+{
+	PROFILE_ISR(PROFILE_TIMER1_COMPA, TCNT1 - OCR_IR);
+	const uint16_t* edge = nextEdge - 1;
+	uint16_t next = *nextEdge++;
+	if (next) // Preload the following edge
+	{
+		OCR_IR = frameStart + next;
+		TCCR1A ^= COM_IR_SET ^ COM_IR_CLEAR; // Alternate set/clear on match
+	}
+	else // Frame finished
+	{
+		nextEdge = NULL;
+		TCCR1A = 0; // Disconnect compare output
+		bitClear(TIMSK1, OCIE_IR); // Disable this interrupt
+		bitClear(PORT_LED_EYE, LED_EYE); // Active low
+	}
+	TRACE_EDGE(edge);
+}
+#else
+ISR(TIMER1_COMPA_vect) // IR pulse rising edge
+{
+	bitSet(PORT_LED_IR, LED_IR);
+	PROFILE_ISR(PROFILE_TIMER1_COMPA, TCNT1 - OCR1A); // After the edge, profile builds keep its timing
+#ifdef SYNC_ICP
+	if (statFirst)
+	{
+		statFirst = false;
+		irStats.latency[StatBin(TCNT1 - frameSync, STAT_LATENCY_BIN0)]++;
+	}
+#endif
+
+	ReleaseSof();
+	const uint16_t* edge = nextEdge - 1;
+	uint16_t end = frameStart + *nextEdge++;
+	HoldSof(end);
+	OCR1B = end; // Pulse end
+	TIFR1 = _BV(OCF1B); // Clear stale match
+	TIMSK1 ^= _BV(OCIE1A) | _BV(OCIE1B); // Hand over to falling edge interrupt
+	TRACE_EDGE(edge);
+}
+ISR(TIMER1_COMPB_vect) // IR pulse falling edge
+{
+	bitClear(PORT_LED_IR, LED_IR);
+	PROFILE_ISR(PROFILE_TIMER1_COMPB, TCNT1 - OCR1B);
+
+	ReleaseSof();
+	const uint16_t* edge = nextEdge - 1;
+	uint16_t next = *nextEdge++;
+	if (next) // Next pulse or closing token
+	{
+		HoldSof(frameStart + next);
+		OCR1A = frameStart + next;
+		TIFR1 = _BV(OCF1A); // Clear stale match
+		TIMSK1 ^= _BV(OCIE1A) | _BV(OCIE1B); // Hand over to rising edge interrupt
+	}
+	else // Frame finished
+	{
+		nextEdge = NULL;
+		bitClear(TIMSK1, OCIE1B); // Disable this interrupt
+		bitClear(PORT_LED_EYE, LED_EYE); // Active low
+	}
+	TRACE_EDGE(edge);
+}
+#endif
+
+ISR(TIMER1_OVF_vect) // Timebase upper half and the housekeeping tick, TICK_US
+{
+	PROFILE_ISR(PROFILE_TIMER1_OVF, TCNT1);
+	timeHigh++;
+	Timer_Tick();
+}
+
+ISR(TIMER1_COMPC_vect) // Predicted display frame start, less the lead: driver sync, free-run or external sync
+{
+	PROFILE_ISR(PROFILE_TIMER1_COMPC, TCNT1 - OCR1C);
+	int16_t lead = frameLead;
+	uint16_t edge = pllEdge >> PLL_FRAC_BITS;
+	uint16_t start = edge - lead;
+	pllEdge += pllPeriod;
+	uint16_t next = (pllEdge >> PLL_FRAC_BITS) - lead;
+	if (IR_SyncMode != SYNCMODE_FREERUN)
+	{
+		// Sync edges and swap packets land either side of the predicted edge: a frame sent
+		// from here may still get its edge late, within the window, so a missing one is
+		// only counted when the next compare comes without it
+		if ((IR_SyncMode == SYNCMODE_DRIVER) && synced)
+			coasted = 0;
+		else if (++coasted > (flywheelFrames + 1))
+		{
+			PLL_Stop(); // Source gone for good, IR_Update times out
+			return;
+		}
+		if (IR_SyncMode & SYNCMODE_EXTERNAL)
+		{
+			pllEye = armedEye; // Alternated by the last frame or set by a swap packet matched to this one
+			if (coasted > 1)
+			{
+				syncLastEdge += syncPeriod >> PERIOD_AVG_SHIFT; // Stands in for the missing edge
+				irStats.missed++;
+			}
+		}
+	}
+	OCR1C = next;
+
+	if (armedEye != pllEye) // Normally prepared by the last frame or the last swap packet
+		PrepareFrame(pllEye);
+	StartFrame(start, edge);
+	pllEye = !pllEye;
+}
+
+/* VESA 3D sync edge at Timer1 time edge, level: high = left eye, low = right eye */
+static void SyncEdge(uint8_t level, uint16_t edge)
 {
 	if (IR_SyncMode & SYNCMODE_EXTERNAL)
 	{
-		if ((IR_SyncMode == SYNCMODE_EXTERNAL) || ((PIND & _BV(4)) == 0))
+		uint16_t interval = edge - syncLastEdge;
+		int16_t lead = frameLead;
+		bool covered = false; // Frame for this edge already sent, ahead of it or by the flywheel
+		bool deferred = false; // Frame for this edge goes out from TIMER1_COMPC after it
+		if (syncLocked)
+		{
+			uint16_t period = syncPeriod >> PERIOD_AVG_SHIFT;
+			int32_t error = (int32_t)interval - period;
+			if ((error > SYNC_WINDOW) && (period < 0x8000))
+				error -= period; // An edge went missing
+			if ((error > SYNC_WINDOW) || (error < -SYNC_WINDOW))
+			{
+				bool moved = false;
+				for (uint8_t i = 0; i < syncGlitches; i++)
+				{
+					int32_t phase = (int32_t)(uint16_t)(edge - syncDropped[i]) - period;
+					if ((phase <= SYNC_WINDOW) && (phase >= -SYNC_WINDOW))
+						moved = true;
+				}
+				if (!moved)
+				{
+					TRACE(TRACE_SYNC_GLITCH | level, edge);
+					irStats.glitches++;
+					syncDropped[syncGlitches] = edge;
+					if (++syncGlitches >= SYNC_MAX_GLITCHES)
+					{
+						syncLocked = false; // Rate changed, detect it again from here
+						syncLastEdge = edge;
+						PLL_Stop(); // Flywheel
+					}
+					return;
+				}
+				error = 0; // Follow the new phase
+			}
+			syncGlitches = 0;
+			syncPeriod += error;
+			covered = (uint16_t)(edge - statLastStart) < (period / 2);
+			deferred = !covered && (lead < 0) && (TIMSK1 & _BV(OCIE1C));
+		}
+
+		// Start the frame first, it was prepared for the eye that follows the last one
+		bool fromLevel = (IR_SyncMode == SYNCMODE_EXTERNAL) || ((PIN_POLSEL & _BV(POLSEL)) == 0);
+		uint8_t eye = (level ^ swapEyes) ^ covered; // Of the next frame not sent yet
+		bool active = emitterActive;
+		bool fix = fromLevel && active && (eye == curEye);
+		if (fromLevel)
+		{
+			if (eye != armedEye)
+				PrepareFrame(eye); // Out of turn
+			synced = true;
+		}
+		bool started = false;
+		if (covered || deferred)
+			coasted = 0;
+		else if (synced)
 		{
-			// VESA 3D sync: high = left eye, low = right eye
-			IR_SetEye((PIN_SYNCIN & _BV(SYNCIN)) != 0);
+			coasted = 0;
+			started = true;
 		}
-		
-		if (synced) // When using USB sync
-			IR_StartFrame();
+		else if (active && (coasted < flywheelFrames))
+		{
+			coasted++; // Swap packet late or lost, keep alternating
+			started = true;
+		}
+		if (started) // Otherwise waiting for USB sync
+			StartFrame(edge, edge);
+
+		TRACE(TRACE_SYNC_EDGE | level, edge);
+		if (fix)
+			irStats.eyeFixes++;
+		if (syncLocked && (started || covered || deferred) && (flywheelFrames || lead))
+		{
+			// Next frame the lead ahead of its predicted edge, sent whether the edge comes or not
+			pllPeriod = syncPeriod << (PLL_FRAC_BITS - PERIOD_AVG_SHIFT);
+			pllEdge = ((uint32_t)edge << PLL_FRAC_BITS) + (deferred ? 0 : pllPeriod);
+			pllEye = armedEye;
+			uint16_t next = (pllEdge >> PLL_FRAC_BITS) - lead;
+			if ((uint16_t)(next - edge) < (uint16_t)(TCNT1 - edge + PLL_MIN_LEAD))
+				next = TCNT1 + PLL_MIN_LEAD; // Unsigned from the edge: below 61Hz the period passes 0x7FFF
+			OCR1C = next;
+			TIFR1 = _BV(OCF1C); // Clear stale match
+			bitSet(TIMSK1, OCIE1C);
+		}
+		syncLastEdge = edge;
+		if (!syncLocked && (syncCount < SYNC_DETECT_EDGES) && (interval >= PERIOD_MIN) && (interval <= PERIOD_MAX))
+			syncIntervals[syncCount++] = interval; // Rate detection in the main loop
+		if (active && statPeriod && (interval > (statPeriod + statPeriod / 2)))
+			irStats.missed++;
 	}
 }
+
+#ifdef SYNC_ICP
+ISR(TIMER1_CAPT_vect) // Frame sync edge, time latched by the input capture unit
+{
+	PROFILE_ISR(PROFILE_TIMER1_CAPT, TCNT1 - ICR1);
+	uint16_t edge = ICR1;
+	uint8_t level = (TCCR1B & _BV(ICES1)) != 0; // Rising edge captured = now high
+	// Catch the edge away from the current level next, going by the pin rather than the
+	// edge just captured: a short glitch may have ended before this point
+	if (PIN_SYNCIN_ICP & _BV(SYNCIN_ICP))
+		TCCR1B &= ~_BV(ICES1);
+	else
+		TCCR1B |= _BV(ICES1);
+	TIFR1 = _BV(ICF1); // Edge select change may raise a false capture
+
+	SyncEdge(level, edge);
+}
+#else
+// Frame sync edge
+ISR (INT1_vect)
+{
+	PROFILE_ISR(PROFILE_INT1, PROFILE_NO_LATENCY);
+	SyncEdge((PIN_SYNCIN & _BV(SYNCIN)) != 0, IR_Timestamp());
+}
+#endif
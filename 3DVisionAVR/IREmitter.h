@@ -2,18 +2,59 @@
 #ifndef _IREMITTER_H_
 #define _IREMITTER_H_
 
-// Frame exposure duration in half-microseconds (@16MHz)
+// Timebase: free-running Timer1 extended to 32 bits, half-microsecond ticks
+#define TICKS_PER_US    2
+#define TICKS_MS(ms)    ((ms) * 1000UL * TICKS_PER_US)
+
+// Frame exposure duration in half-microseconds (@16MHz) until the frame period is measured
 #define FRAME_DURATION  (2*4000)
-// Time between sync trigger and start of IR token (same units)
+// Time between sync trigger and start of IR token (same units). With SYNC_ICP
+// the offset is exact as long as the capture interrupt has armed the timer within
+// it, otherwise the first pulse goes out from the interrupt that starts the frame
+// and this is only the schedule's origin
+#ifdef SYNC_ICP
+#define FRAME_PAN       (2*10)
+#else
 #define FRAME_PAN       (10)
+#endif
 
 // INT1, pin 2 on "Arduino Pro Micro"
 #define SYNCIN          1
 #define PIN_SYNCIN      PIND
 
+// Take the sync signal on the Timer1 input capture pin instead of INT1: edge time
+// is latched in hardware (noise canceller on) and polarity follows the captured edge
+//#define SYNC_ICP
+// ICP1, pin 4 on "Arduino Pro Micro"
+#define SYNCIN_ICP      4
+#define PIN_SYNCIN_ICP  PIND
+
+// Combined mode: pull low to take eye polarity from VESA sync instead of driver
+#ifdef SYNC_ICP
+#define POLSEL          7 // Pin 6 on "Arduino Pro Micro", pin 4 is the sync input
+#else
+#define POLSEL          4
+#endif
+#define PIN_POLSEL      PIND
+
 #define LED_IR          0
 #define DDR_LED_IR      DDRD
 #define PORT_LED_IR     PORTD
+
+// Generate IR pulses with the Timer1 compare output hardware instead of
+// GPIO writes from the ISRs, edges then don't depend on interrupt latency
+//#define IR_HW_PULSE
+// OC1A, pin 9 on "Arduino Pro Micro" (OC1B is taken by LED_STBY)
+#define LED_IR_OC       5
+#define DDR_LED_IR_OC   DDRB
+#define PORT_LED_IR_OC  PORTB
+#define OCR_IR          OCR1A
+#define OCIE_IR         OCIE1A
+#define OCF_IR          OCF1A
+#define COM_IR_SET      (_BV(COM1A1) | _BV(COM1A0)) // Set on compare match
+#define COM_IR_CLEAR    _BV(COM1A1)                 // Clear on compare match
+#define FOC_IR          FOC1A
+#define IR_OC_vect      TIMER1_COMPA_vect
 #define LED_EYE         0
 #define DDR_LED_EYE     DDRB
 #define PORT_LED_EYE    PORTB
@@ -29,15 +70,80 @@ typedef enum {
 	SYNCMODE_FREERUN  = 4
 } SyncMode_t;
 
-SyncMode_t IR_SyncMode;
+extern SyncMode_t IR_SyncMode;
+
+// Longest token the compare schedule has room for, in timing entries
+#define IR_MAX_TOKEN_SIZE 15
+#define IR_MAX_TIMINGS    (4 * IR_MAX_TOKEN_SIZE)
+// Shortest pulse or gap an uploaded protocol may use, in us
+#define IR_MIN_TIMING     10
+
+// Built-in protocols sent alongside the active one for rooms with mixed glasses
+// (CMD_PROTOCOL_MIX). Their tokens go between the active protocol's on the same IR pin, at
+// least the gap apart. Doubles the compare schedule, 256 bytes more SRAM
+//#define IR_MIX
+#ifdef IR_MIX
+#define IR_MIX_MAX        2
+#else
+#define IR_MIX_MAX        0
+#endif
+#define IR_MIX_GAP        100 // Default clearance between tokens of different protocols, in us
+
+// Furthest the opening token may be moved from the frame edge, either way, in us
+#define IR_LEAD_MAX       2000
+
+// Uploaded protocol image, also the EEPROM copy: sizes[4], indices[4], duty,
+// guard (2 bytes), lead (2 bytes), then the timings, all 16-bit values little endian
+#define IR_IMAGE_HEADER   13
+#define IR_IMAGE_MAX      (IR_IMAGE_HEADER + 2 * IR_MAX_TIMINGS)
+
+typedef enum {
+	IR_UPLOAD_OK      = 0,
+	IR_UPLOAD_RANGE   = 1, // Chunk outside the image buffer
+	IR_UPLOAD_INVALID = 2, // Image failed validation, current protocol kept
+	IR_UPLOAD_BUSY    = 3  // Previous upload still being stored
+} IR_UploadStatus_t;
+
+// Running sync quality counters. They wrap, readers work with the difference
+// between two snapshots
+#define IR_STATS_BINS 8
+typedef struct {
+	uint32_t frames[2];               // Frames started per eye
+	uint16_t missed;                  // Sync edges or swap packets over 1.5 frame periods apart
+	uint16_t late;                    // Frames shifted because their start was held up
+	uint16_t timeouts;                // Sync lost for SYNC_TIMEOUT
+	uint16_t eyeFixes;                // Eye polarity corrected by the sync source
+	uint16_t glitches;                // External sync edges dropped off the locked refresh rate
+	uint16_t eyeSlips;                // Combined mode swap packets taken as a frame later or earlier than before
+	uint16_t period[IR_STATS_BINS];   // Frame start interval error, bin n below 1us << n
+	uint16_t latency[IR_STATS_BINS];  // Sync reference to first IR edge, bin n below 8us << n
+	uint16_t framePeriod;             // Tracked frame period in ticks, 0 while unknown
+	uint16_t window;                  // Current shutter open window in ticks
+} IR_Stats_t;
 
 void IR_Init(void);
-void IR_Update(uint32_t curTime);
+void IR_Update(void);
 void IR_SetSyncMode(SyncMode_t mode);
 void IR_SwapEyes(uint8_t swap);
+IR_UploadStatus_t IR_SetFreerunRate(uint32_t rate);
+void IR_SetFlywheel(uint8_t frames);
 
 void IR_SetEye(uint8_t eye);
 void IR_StartFrame(void);
 //void IR_EndFrame(void);
 
+uint32_t IR_Time(void);
+uint16_t IR_Timestamp(void);
+void IR_DriverSync(uint8_t eye, uint16_t stamp);
+
+IR_UploadStatus_t IR_UploadProtocol(uint8_t offset, const uint8_t* data, uint8_t amount);
+IR_UploadStatus_t IR_CommitProtocol(uint8_t length);
+IR_UploadStatus_t IR_SelectProtocol(uint8_t id);
+bool IR_ProtocolStoring(void);
+uint8_t IR_ProtocolID(void);
+IR_UploadStatus_t IR_MixProtocols(const uint8_t* ids, uint8_t count, uint8_t gap);
+IR_UploadStatus_t IR_SetProtocolLead(int16_t lead);
+
+void IR_GetStats(IR_Stats_t* stats);
+
 #endif /* _IREMITTER_H_ */
@@ -0,0 +1,102 @@
+/** \file
+ *
+ *  Built-in IR protocol tables. They stay in flash, only the active protocol is
+ *  copied to SRAM by IR_ReadProtocol().
+ */
+
+#include "Emitter.h"
+#include "IRProtocols.h"
+#include <avr/pgmspace.h>
+
+static const IR_Protocol_t IRProt_Samsung07 PROGMEM = {
+	.sizes   = { 5,0, 0,0 },
+	.indices = { 0,0, 0,0 },
+	.duty    = IR_DUTY_DEFAULT,
+	.guard   = IR_GUARD_DEFAULT,
+	.lead    = 500,
+	.timings = { 14,12,14,12,14 }
+};
+static const IR_Protocol_t IRProt_Xpand PROGMEM = {
+	.sizes   = { 5,0, 3,0 },
+	.indices = { 0,0, 5,0 },
+	.duty    = IR_DUTY_DEFAULT,
+	.guard   = IR_GUARD_DEFAULT,
+	.lead    = 300,
+	.timings = { 18,20,18,20,18,  18,60,18 }
+};
+static const IR_Protocol_t IRProt_3DVision PROGMEM = {
+	.sizes   = { 3,3, 1,3 },
+	.indices = { 0,3, 6,7 },
+	.duty    = IR_DUTY_DEFAULT,
+	.guard   = IR_GUARD_DEFAULT,
+	.lead    = 0,
+	.timings = { 23,46,31,  23,78,40, 
+	             43,        23,21,24 }
+};
+static const IR_Protocol_t IRProt_Sharp PROGMEM = {
+	.sizes   = { 15,0, 15,0 },
+	.indices = { 0,0, 15,0 },
+	.duty    = IR_DUTY_DEFAULT,
+	.guard   = IR_GUARD_DEFAULT,
+	.lead    = 400,
+	.timings = { 20,20,20,20,20,80,20,140,20,20,20,80,20,20,20,
+	             20,20,20,20,20,60,20, 60,20,20,20,80,20,20,20 }
+};
+static const IR_Protocol_t IRProt_Sony PROGMEM = {
+	.sizes   = { 9,9, 9,9 },
+	.indices = { 27, 0,9, 18 },
+	.duty    = IR_DUTY_DEFAULT,
+	.guard   = IR_GUARD_DEFAULT,
+	.lead    = 400,
+	.timings = { 20,20,20,20,20,300,20,20,20,  20,20,20,20,20,220,20,20,20,
+	             20,20,20,20,20,140,20,20,20,  20,20,20,20,20,380,20,20,20 }
+};
+static const IR_Protocol_t IRProt_Panasonic PROGMEM = {
+	.sizes   = { 7,7, 7,7 },
+	.indices = { 0,7, 14,21 },
+	.duty    = IR_DUTY_DEFAULT,
+	.guard   = IR_GUARD_DEFAULT,
+	.lead    = 400,
+	.timings = { 20,20,20,100,20,20,20,  20,60,20,20,20,60,20,
+	             20,60,20, 60,20,20,20,  20,20,20,60,20,60,20 }
+};
+
+static const IR_Protocol_t* const IR_Protocols[IR_PROTOCOL_COUNT] PROGMEM = {
+	[IR_PROTOCOL_SAMSUNG07] = &IRProt_Samsung07,
+	[IR_PROTOCOL_XPAND]     = &IRProt_Xpand,
+	[IR_PROTOCOL_3DVISION]  = &IRProt_3DVision,
+	[IR_PROTOCOL_SHARP]     = &IRProt_Sharp,
+	[IR_PROTOCOL_SONY]      = &IRProt_Sony,
+	[IR_PROTOCOL_PANASONIC] = &IRProt_Panasonic,
+};
+
+/* Flash address of built-in protocol id, NULL if there is none. Read it with the _P functions */
+const IR_Protocol_t* IR_ProtocolTable(uint8_t id)
+{
+	if (id >= IR_PROTOCOL_COUNT)
+		return NULL;
+	return pgm_read_ptr(&IR_Protocols[id]);
+}
+
+/* Copies built-in protocol id from flash, protocol has room for maxTimings timings */
+bool IR_ReadProtocol(uint8_t id, IR_Protocol_t* protocol, uint8_t maxTimings)
+{
+	const IR_Protocol_t* table = IR_ProtocolTable(id);
+	if (!table)
+		return false;
+
+	uint8_t count = 0; // Timings end after the last token
+	for (uint8_t token = 0; token < 4; token++)
+	{
+		uint8_t size = pgm_read_byte(&table->sizes[token]);
+		uint8_t end = pgm_read_byte(&table->indices[token]) + size;
+		if (size && (end > count))
+			count = end;
+	}
+	if (count > maxTimings)
+		return false;
+
+	memcpy_P(protocol, table, sizeof(IR_Protocol_t));
+	memcpy_P(protocol->timings, table->timings, count * sizeof(uint16_t));
+	return true;
+}
@@ -5,47 +5,42 @@
 // Definitions for IR protocols, indexed in this order:
 // [0]: Open right eye [1]: Close right eye
 // [2]: Open left eye  [3]: Close left eye
+// Shutter open window between opening and closing token follows the measured
+// frame period: period * duty / 256 - guard
+
+// 60% of the period less 1ms, about 4ms at 120Hz
+#define IR_DUTY_DEFAULT   154
+#define IR_GUARD_DEFAULT  1000
+// Leads make up for the glasses' shutter reaction: TV glasses take a few hundred us to open,
+// the oldest most, 3D Vision glasses expect the token at the frame edge like NVIDIA's emitter
+// sends it. The built-ins' are a starting point, single pairs still differ: the host sets its
+// own (CMD_PROTOCOL_LEAD), kept per protocol in EEPROM
 
 typedef struct
 {
 	uint8_t sizes[4];
 	uint8_t indices[4];
+	uint8_t duty;   // Open share of the frame period, 1/256 units
+	uint16_t guard; // Left for shutter response, in us
+	int16_t lead;   // Opening token ahead of the predicted frame edge, in us, negative for after it
 	uint16_t timings[];
 } IR_Protocol_t;
 
-const IR_Protocol_t IRProt_Samsung07 = {
-	.sizes   = { 5,0, 0,0 },
-	.indices = { 0,0, 0,0 },
-	.timings = { 14,12,14,12,14 }
-};
-const IR_Protocol_t IRProt_Xpand = {
-	.sizes   = { 5,0, 3,0 },
-	.indices = { 0,0, 5,0 },
-	.timings = { 18,20,18,20,18,  18,60,18 }
-};
-const IR_Protocol_t IRProt_3DVision = {
-	.sizes   = { 3,3, 1,3 },
-	.indices = { 0,3, 6,7 },
-	.timings = { 23,46,31,  23,78,40, 
-	             43,        23,21,24 }
-};
-const IR_Protocol_t IRProt_Sharp = {
-	.sizes   = { 15,0, 15,0 },
-	.indices = { 0,0, 15,0 },
-	.timings = { 20,20,20,20,20,80,20,140,20,20,20,80,20,20,20,
-	             20,20,20,20,20,60,20, 60,20,20,20,80,20,20,20 }
-};
-const IR_Protocol_t IRProt_Sony = {
-	.sizes   = { 9,9, 9,9 },
-	.indices = { 27, 0,9, 18 },
-	.timings = { 20,20,20,20,20,300,20,20,20,  20,20,20,20,20,220,20,20,20,
-	             20,20,20,20,20,140,20,20,20,  20,20,20,20,20,380,20,20,20 }
-};
-const IR_Protocol_t IRProt_Panasonic = {
-	.sizes   = { 7,7, 7,7 },
-	.indices = { 0,7, 14,21 },
-	.timings = { 20,20,20,100,20,20,20,  20,60,20,20,20,60,20,
-	             20,60,20, 60,20,20,20,  20,20,20,60,20,60,20 }
-};
+// Built-in protocols, tables are kept in flash (IRProtocols.c)
+typedef enum {
+	IR_PROTOCOL_SAMSUNG07 = 0,
+	IR_PROTOCOL_XPAND     = 1,
+	IR_PROTOCOL_3DVISION  = 2,
+	IR_PROTOCOL_SHARP     = 3,
+	IR_PROTOCOL_SONY      = 4,
+	IR_PROTOCOL_PANASONIC = 5,
+	IR_PROTOCOL_COUNT,
+	IR_PROTOCOL_UPLOADED  = 0xFF // Not built in, from a host upload
+} IR_ProtocolID_t;
+
+#define IR_PROTOCOL_DEFAULT IR_PROTOCOL_3DVISION
+
+const IR_Protocol_t* IR_ProtocolTable(uint8_t id);
+bool IR_ReadProtocol(uint8_t id, IR_Protocol_t* protocol, uint8_t maxTimings);
 
 #endif /* _IRPROTOCOLS_H_ */
@@ -0,0 +1,70 @@
+/** \file
+ *
+ *  ISR profiler, built with EMITTER_PROFILE, see Profile.h.
+ */
+
+#include "Emitter.h"
+#include "Profile.h"
+
+#ifdef EMITTER_PROFILE
+static Profile_Record_t profile[PROFILE_VECTORS];
+static uint32_t profileSince; // IR_Time() of the last reset
+uint32_t profileNested;
+uint32_t profileLoops;
+
+/* Starts Timer3 as the cycle counter, takes the place of power_timer3_disable() */
+void Profile_Init(void)
+{
+	TCCR3A = 0;
+	TCCR3B = _BV(CS30); // clk/1, normal mode
+	Profile_Reset();
+}
+
+void Profile_Reset(void)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	memset(profile, 0, sizeof(profile));
+	for (uint8_t i = 0; i < PROFILE_VECTORS; i++)
+		profile[i].min = 0xFFFF;
+	profileLoops = 0;
+	profileSince = IR_Time();
+	SetGlobalInterruptMask(sreg);
+}
+
+/* Cleanup of PROFILE_ISR's mark, runs as the handler returns */
+void Profile_Exit(Profile_Mark_t* mark)
+{
+	GlobalInterruptDisable(); // USB_COM_vect may return with interrupts on
+	uint16_t cycles = TCNT3 - mark->start;
+	uint16_t ticks = TCNT1 - mark->coarse;
+	// Timer3 wraps every 4.1ms, the wraps come from Timer1 at 8 cycles a tick
+	uint32_t total = (((uint32_t)ticks * 8 - cycles + 0x8000) & 0xFFFF0000) | cycles;
+	uint32_t own = total - (profileNested - mark->nested);
+	profileNested += own;
+
+	Profile_Record_t* record = &profile[mark->vector];
+	record->count++;
+	record->sum += own;
+	if (own > record->max)
+		record->max = own;
+	if (own < record->min)
+		record->min = own;
+	if ((mark->latency > 0) && ((uint16_t)mark->latency > record->latency))
+		record->latency = mark->latency;
+}
+
+/* Copy of one vector's record, from the main loop */
+void Profile_Read(uint8_t vector, Profile_Record_t* record)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	*record = profile[vector];
+	SetGlobalInterruptMask(sreg);
+}
+
+uint32_t Profile_Elapsed(void)
+{
+	return IR_Time() - profileSince;
+}
+#endif
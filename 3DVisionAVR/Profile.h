@@ -0,0 +1,73 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdint.h>
+#include <avr/io.h>
+
+// ISR profiler for builds with EMITTER_PROFILE (Emitter.h). Timer3 free-runs at clk/1 and each
+// instrumented handler is stamped from its PROFILE_ISR line to its return; prologue, epilogue
+// and the bookkeeping itself are left out. Time spent in ISRs nested inside USB_COM_vect is
+// counted to them, not to USB_COM_vect. Read out with CMD_PROFILE
+typedef enum {
+	PROFILE_TIMER1_COMPA = 0, // IR pulse rising edge, every edge with IR_HW_PULSE
+	PROFILE_TIMER1_COMPB,     // IR pulse falling edge
+	PROFILE_TIMER1_COMPC,     // Predicted frame start
+	PROFILE_TIMER1_CAPT,      // Sync edge with SYNC_ICP
+	PROFILE_TIMER1_OVF,       // Timebase upper half, housekeeping tick and the timer wheel
+	PROFILE_INT1,             // Sync edge
+	PROFILE_USART1_UDRE,      // Serial out
+	PROFILE_USB_COM,          // Swap packets and control requests
+	PROFILE_USB_SOF,          // Start-of-Frame handler, the rest of LUFA's USB_GEN_vect isn't covered
+	PROFILE_VECTORS
+} Profile_Vector_t;
+
+// Entry latency argument for vectors without a hardware reference time
+#define PROFILE_NO_LATENCY  (-1)
+
+typedef struct {
+	uint32_t count;
+	uint32_t sum;     // Cycles
+	uint32_t max;     // Cycles
+	uint16_t min;     // Cycles, saturates
+	uint16_t latency; // Worst flag to PROFILE_ISR delay in Timer1 ticks, 0 without a reference
+} Profile_Record_t;
+
+typedef struct {
+	uint16_t start;   // Timer3 at entry
+	uint16_t coarse;  // Timer1 at entry, counts the Timer3 wraps of long handlers
+	uint32_t nested;  // profileNested at entry
+	int16_t  latency;
+	uint8_t  vector;
+} Profile_Mark_t;
+
+extern uint32_t profileNested; // Cycles of all handlers so far, outer ones take it off theirs
+extern uint32_t profileLoops; // Main loop iterations
+
+void Profile_Init(void);
+void Profile_Reset(void);
+void Profile_Exit(Profile_Mark_t* mark);
+void Profile_Read(uint8_t vector, Profile_Record_t* record);
+uint32_t Profile_Elapsed(void); // Timer1 ticks since the last reset
+
+#ifdef EMITTER_PROFILE
+static inline Profile_Mark_t Profile_Enter(uint8_t vector, int16_t latency)
+{
+	Profile_Mark_t mark;
+	mark.start = TCNT3;
+	mark.coarse = TCNT1;
+	mark.nested = profileNested;
+	mark.latency = latency;
+	mark.vector = vector;
+	return mark;
+}
+
+// First statement of a handler, latency: Timer1 ticks since its flag was raised or PROFILE_NO_LATENCY
+#define PROFILE_ISR(vector, latency) \
+	Profile_Mark_t profileMark __attribute__((cleanup(Profile_Exit))) = Profile_Enter(vector, latency)
+#define PROFILE_LOOP() (profileLoops++)
+#else
+#define PROFILE_ISR(vector, latency)
+#define PROFILE_LOOP()
+#endif
+
+#endif /* _PROFILE_H_ */
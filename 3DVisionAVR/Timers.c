@@ -0,0 +1,86 @@
+/** \file
+ *
+ *  Timer wheel driven by the housekeeping tick, see Timers.h.
+ */
+
+#include "Emitter.h"
+#include "Timers.h"
+
+static Timer_Event_t* timerSlots[TIMER_SLOTS];
+static Timer_Event_t* timerDue; // Slot being walked by Timer_Tick(), taken out of the wheel
+static uint8_t timerNow; // Ticks so far, wraps
+
+static void Link(Timer_Event_t* event, Timer_Event_t** slot)
+{
+	event->next = *slot;
+	if (event->next)
+		event->next->link = &event->next;
+	event->link = slot;
+	*slot = event;
+}
+
+/* (Re)starts event to fire ticks from now, 0 counts as 1 and anything past TIMER_MAX_TICKS
+   as that. Interrupts may be on */
+void Timer_Start(Timer_Event_t* event, uint16_t ticks)
+{
+	if (ticks == 0)
+		ticks = 1;
+	else if (ticks > TIMER_MAX_TICKS)
+		ticks = TIMER_MAX_TICKS;
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	Timer_Stop(event);
+	event->turns = (ticks - 1) / TIMER_SLOTS;
+	Link(event, &timerSlots[(uint8_t)(timerNow + ticks) & (TIMER_SLOTS - 1)]);
+	SetGlobalInterruptMask(sreg);
+}
+
+/* Stops event if it's running. Interrupts may be on */
+void Timer_Stop(Timer_Event_t* event)
+{
+	uint_reg_t sreg = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+	if (event->link)
+	{
+		*event->link = event->next;
+		if (event->next)
+			event->next->link = event->link;
+		event->link = NULL;
+	}
+	SetGlobalInterruptMask(sreg);
+}
+
+bool Timer_Running(const Timer_Event_t* event)
+{
+	return event->link != NULL;
+}
+
+/* Advances the wheel by a tick and runs the handlers due. From the tick ISR, interrupts off.
+   Handlers may start and stop any event: the slot is walked from timerDue, so whatever
+   lands in it meanwhile waits for the next turn */
+void Timer_Tick(void)
+{
+	Timer_Event_t** slot = &timerSlots[++timerNow & (TIMER_SLOTS - 1)];
+	timerDue = *slot;
+	*slot = NULL;
+	if (timerDue)
+		timerDue->link = &timerDue;
+
+	Timer_Event_t* event;
+	while ((event = timerDue) != NULL)
+	{
+		timerDue = event->next;
+		if (timerDue)
+			timerDue->link = &timerDue;
+		if (event->turns)
+		{
+			event->turns--;
+			Link(event, slot);
+		}
+		else
+		{
+			event->link = NULL;
+			event->handler();
+		}
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef _TIMERS_H_
+#define _TIMERS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Timeouts only: sync loss, the statistics interval and the housekeeping tick itself, advanced
+// by the Timer1 overflow (TICK_US in Emitter.h). IR pulse edges and frame starts need finer
+// timing than a tick and stay on the Timer1 compare units. A hashed timing wheel: an event
+// goes into the slot its expiry falls on with the number of whole turns still to wait, so
+// starting, restarting and stopping one is O(1) and a tick only walks its slot. Handlers run
+// from the tick interrupt with interrupts off, keep them short
+#define TIMER_SLOTS     32 // Power of two, at most 256
+#define TIMER_MAX_TICKS (TIMER_SLOTS * 256) // Longest timeout the 8 bit turn count reaches, longer ones are cut to it
+
+// Ticks for a timeout of ms, rounded up. Constant arguments fold at compile time, so frame
+// interrupts restarting a timeout don't divide
+#define TIMER_MS(ms)    (((uint32_t)(ms) * 1000 + TICK_US - 1) / TICK_US)
+
+typedef struct Timer_Event
+{
+	struct Timer_Event*  next;
+	struct Timer_Event** link;    // Pointer to this event in its slot, NULL while stopped
+	uint8_t              turns;   // Wheel turns left before it fires
+	void               (*handler)(void);
+} Timer_Event_t;
+
+void Timer_Start(Timer_Event_t* event, uint16_t ticks);
+void Timer_Stop(Timer_Event_t* event);
+bool Timer_Running(const Timer_Event_t* event);
+void Timer_Tick(void);
+
+#endif /* _TIMERS_H_ */
@@ -0,0 +1,149 @@
+/** \file
+ *
+ *  Host-side stand-in for the subset of the LUFA device-mode API used by the emitter.
+ *  Endpoint banks are modelled in sim/usb.c; the host side of each transfer is driven by
+ *  the simulator's stimulus, see Sim_USB_QueueOUT().
+ */
+
+#ifndef _SIM_LUFA_USB_H_
+#define _SIM_LUFA_USB_H_
+
+	#include <stdint.h>
+	#include <stdbool.h>
+	#include <string.h>
+	#include <avr/io.h>
+	#include <avr/interrupt.h>
+
+/* Architecture selection, normally supplied by the LUFA build system */
+	#define ARCH_AVR8  0
+	#define ARCH_XMEGA 2
+	#ifndef ARCH
+		#define ARCH ARCH_AVR8
+	#endif
+
+/* Attributes */
+	#define ATTR_WARN_UNUSED_RESULT      __attribute__((warn_unused_result))
+	#define ATTR_NON_NULL_PTR_ARG(...)   __attribute__((nonnull(__VA_ARGS__)))
+	#define ATTR_PACKED                  __attribute__((packed))
+	#define PROGMEM
+
+	typedef uint8_t uint_reg_t;
+
+	#define GlobalInterruptEnable()  sei()
+	#define GlobalInterruptDisable() cli()
+
+	static inline uint_reg_t GetGlobalInterruptMask(void)
+	{
+		return SREG;
+	}
+
+	static inline void SetGlobalInterruptMask(const uint_reg_t GlobalIntState)
+	{
+		SREG = GlobalIntState;
+	}
+
+	static inline void USB_Device_EnableSOFEvents(void)
+	{
+		UDIEN |= (1 << SOFE);
+	}
+
+	static inline void USB_Device_DisableSOFEvents(void)
+	{
+		UDIEN &= ~(1 << SOFE);
+	}
+
+/* Descriptor types, only as far as Descriptors.h needs them */
+	typedef struct { uint8_t Size; uint8_t Type; } ATTR_PACKED USB_Descriptor_Header_t;
+	typedef struct { uint8_t bLength; uint8_t bDescriptorType; uint16_t wTotalLength;
+	                 uint8_t bNumInterfaces; uint8_t bConfigurationValue; uint8_t iConfiguration;
+	                 uint8_t bmAttributes; uint8_t bMaxPower; } ATTR_PACKED USB_StdDescriptor_Configuration_Header_t;
+	typedef struct { USB_Descriptor_Header_t Header; uint8_t InterfaceNumber; uint8_t AlternateSetting;
+	                 uint8_t TotalEndpoints; uint8_t Class; uint8_t SubClass; uint8_t Protocol;
+	                 uint8_t InterfaceStrIndex; } ATTR_PACKED USB_Descriptor_Interface_t;
+	typedef struct { USB_Descriptor_Header_t Header; uint8_t EndpointAddress; uint8_t Attributes;
+	                 uint16_t EndpointSize; uint8_t PollingIntervalMS; } ATTR_PACKED USB_Descriptor_Endpoint_t;
+
+/* Control requests */
+	typedef struct
+	{
+		uint8_t  bmRequestType;
+		uint8_t  bRequest;
+		uint16_t wValue;
+		uint16_t wIndex;
+		uint16_t wLength;
+	} ATTR_PACKED USB_Request_Header_t;
+
+	extern USB_Request_Header_t USB_ControlRequest;
+
+/* Device state */
+	enum USB_Device_States_t
+	{
+		DEVICE_STATE_Unattached = 0,
+		DEVICE_STATE_Powered    = 1,
+		DEVICE_STATE_Default    = 2,
+		DEVICE_STATE_Addressed  = 3,
+		DEVICE_STATE_Configured = 4,
+		DEVICE_STATE_Suspended  = 5,
+	};
+
+	extern volatile uint8_t USB_DeviceState;
+
+/* Endpoints */
+	#define ENDPOINT_DIR_OUT   0x00
+	#define ENDPOINT_DIR_IN    0x80
+	#define ENDPOINT_EPNUM_MASK 0x0F
+	#define ENDPOINT_CONTROLEP 0
+
+	#define EP_TYPE_CONTROL     0x00
+	#define EP_TYPE_ISOCHRONOUS 0x01
+	#define EP_TYPE_BULK        0x02
+	#define EP_TYPE_INTERRUPT   0x03
+
+	enum Endpoint_Stream_RW_ErrorCodes_t
+	{
+		ENDPOINT_RWSTREAM_NoError = 0,
+	};
+
+	enum Endpoint_WaitUntilReady_ErrorCodes_t
+	{
+		ENDPOINT_READYWAIT_NoError = 0,
+	};
+
+	void     USB_Init(void);
+	void     USB_USBTask(void);
+	void     USB_Device_ProcessControlRequest(void);
+
+	bool     Endpoint_ConfigureEndpoint(const uint8_t Address, const uint8_t Type, const uint16_t Size, const uint8_t Banks);
+	void     Endpoint_SelectEndpoint(const uint8_t Address);
+	uint8_t  Endpoint_GetCurrentEndpoint(void);
+	bool     Endpoint_IsConfigured(void);
+	bool     Endpoint_IsReadWriteAllowed(void);
+	bool     Endpoint_IsOUTReceived(void);
+	bool     Endpoint_IsINReady(void);
+	uint16_t Endpoint_BytesInEndpoint(void);
+	void     Endpoint_ClearOUT(void);
+	void     Endpoint_ClearIN(void);
+	uint8_t  Endpoint_WaitUntilReady(void);
+	uint8_t  Endpoint_Read_8(void);
+	void     Endpoint_Write_8(const uint8_t Data);
+	void     Endpoint_Write_16_LE(const uint16_t Data);
+	void     Endpoint_Write_32_LE(const uint32_t Data);
+	uint8_t  Endpoint_Read_Stream_LE(void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed);
+	uint8_t  Endpoint_Write_Stream_LE(const void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed);
+	uint8_t  Endpoint_Discard_Stream(uint16_t Length, uint16_t* const BytesProcessed);
+	uint8_t  Endpoint_Null_Stream(uint16_t Length, uint16_t* const BytesProcessed);
+
+	void     Endpoint_ClearSETUP(void);
+	void     Endpoint_ClearStatusStage(void);
+
+/* Application callbacks, implemented by the firmware */
+	void EVENT_USB_Device_Connect(void);
+	void EVENT_USB_Device_Disconnect(void);
+	void EVENT_USB_Device_ConfigurationChanged(void);
+	void EVENT_USB_Device_ControlRequest(void);
+	void EVENT_USB_Device_Reset(void);
+	void EVENT_USB_Device_Suspend(void);
+	void EVENT_USB_Device_WakeUp(void);
+	void EVENT_USB_Device_StartOfFrame(void);
+
+#endif /* _SIM_LUFA_USB_H_ */
@@ -0,0 +1,11 @@
+/** \file
+ *
+ *  Host-side stand-in for LUFA's Platform.h.
+ */
+
+#ifndef _SIM_LUFA_PLATFORM_H_
+#define _SIM_LUFA_PLATFORM_H_
+
+	#include "../Drivers/USB/USB.h"
+
+#endif /* _SIM_LUFA_PLATFORM_H_ */
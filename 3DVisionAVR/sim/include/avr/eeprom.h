@@ -0,0 +1,21 @@
+/** \file
+ *
+ *  Host-side stand-in for <avr/eeprom.h>. The EEPROM contents live in sim.c; a write keeps
+ *  the EEPROM busy for the programming time, like EEPE on the real part.
+ */
+
+#ifndef _SIM_AVR_EEPROM_H_
+#define _SIM_AVR_EEPROM_H_
+
+	#include <stdint.h>
+	#include <stdbool.h>
+	#include <stddef.h>
+
+	#define E2END 0x3FF
+
+	bool    eeprom_is_ready(void);
+	uint8_t eeprom_read_byte(const uint8_t* address);
+	void    eeprom_read_block(void* destination, const void* source, size_t length);
+	void    eeprom_update_byte(uint8_t* address, uint8_t value);
+
+#endif /* _SIM_AVR_EEPROM_H_ */
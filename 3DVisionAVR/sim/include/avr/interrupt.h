@@ -0,0 +1,38 @@
+/** \file
+ *
+ *  Host-side stand-in for <avr/interrupt.h>. Every ISR becomes a plain function which the
+ *  simulator core dispatches by priority; vectors the firmware doesn't implement fall back
+ *  to weak defaults in sim.c which abort the run, like the BADISR reset on the real part.
+ */
+
+#ifndef _SIM_AVR_INTERRUPT_H_
+#define _SIM_AVR_INTERRUPT_H_
+
+	#include "io.h"
+
+	#define sei() do { SREG |=  _BV(SREG_I); } while (0)
+	#define cli() do { SREG &= ~_BV(SREG_I); } while (0)
+
+	#define ISR_BLOCK
+	#define ISR_NOBLOCK
+	#define ISR_NAKED
+	#define reti()
+
+	#define ISR(vector, ...) void vector(void); void vector(void)
+
+	#define INT0_vect         Sim_Vect_INT0
+	#define INT1_vect         Sim_Vect_INT1
+	#define USB_GEN_vect      Sim_Vect_USB_GEN
+	#define USB_COM_vect      Sim_Vect_USB_COM
+	#define TIMER1_CAPT_vect  Sim_Vect_TIMER1_CAPT
+	#define TIMER1_COMPA_vect Sim_Vect_TIMER1_COMPA
+	#define TIMER1_COMPB_vect Sim_Vect_TIMER1_COMPB
+	#define TIMER1_COMPC_vect Sim_Vect_TIMER1_COMPC
+	#define TIMER1_OVF_vect   Sim_Vect_TIMER1_OVF
+	#define TIMER0_COMPA_vect Sim_Vect_TIMER0_COMPA
+	#define TIMER0_COMPB_vect Sim_Vect_TIMER0_COMPB
+	#define TIMER0_OVF_vect   Sim_Vect_TIMER0_OVF
+	#define USART1_UDRE_vect  Sim_Vect_USART1_UDRE
+	#define USART1_TX_vect    Sim_Vect_USART1_TX
+
+#endif /* _SIM_AVR_INTERRUPT_H_ */
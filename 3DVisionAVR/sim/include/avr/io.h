@@ -0,0 +1,175 @@
+/** \file
+ *
+ *  Host-side stand-in for <avr/io.h>. Exposes the ATmega32U4 registers used by the
+ *  firmware as plain variables which the simulator core (sim.c) keeps up to date.
+ *
+ *  Interrupt flag registers and UDR1 are declared 16-bit so that the simulator can tell
+ *  a firmware write apart from a read: it parks bit 8 set before running firmware code,
+ *  and any 8-bit assignment clears it.
+ */
+
+#ifndef _SIM_AVR_IO_H_
+#define _SIM_AVR_IO_H_
+
+	#include <stdint.h>
+	#include <stdbool.h>
+	#include <string.h>
+
+	#define _BV(bit) (1 << (bit))
+
+/* Status register */
+	extern volatile uint8_t SREG;
+	#define SREG_I 7
+
+	extern volatile uint8_t MCUSR;
+	#define WDRF  3
+
+/* GPIO */
+	extern volatile uint8_t PINB, DDRB, PORTB;
+	extern volatile uint8_t PINC, DDRC, PORTC;
+	extern volatile uint8_t PIND, DDRD, PORTD;
+	extern volatile uint8_t PINE, DDRE, PORTE;
+	extern volatile uint8_t PINF, DDRF, PORTF;
+
+/* External interrupts */
+	extern volatile uint8_t  EICRA, EICRB, EIMSK;
+	extern volatile uint16_t EIFR;
+	#define ISC00 0
+	#define ISC01 1
+	#define ISC10 2
+	#define ISC11 3
+	#define ISC20 4
+	#define ISC21 5
+	#define ISC30 6
+	#define ISC31 7
+	#define INT0  0
+	#define INT1  1
+	#define INT2  2
+	#define INT3  3
+	#define INT6  6
+	#define INTF0 0
+	#define INTF1 1
+	#define INTF2 2
+	#define INTF3 3
+	#define INTF6 6
+
+/* TIMER0 */
+	extern volatile uint8_t  TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0;
+	extern volatile uint16_t TIFR0;
+	#define WGM00  0
+	#define WGM01  1
+	#define COM0B0 4
+	#define COM0B1 5
+	#define COM0A0 6
+	#define COM0A1 7
+	#define CS00   0
+	#define CS01   1
+	#define CS02   2
+	#define WGM02  3
+	#define TOIE0  0
+	#define OCIE0A 1
+	#define OCIE0B 2
+	#define TOV0   0
+	#define OCF0A  1
+	#define OCF0B  2
+
+/* TIMER1 */
+	extern volatile uint8_t  TCCR1A, TCCR1B, TIMSK1;
+	/* Force output compare strobes act on the COM1x setting at the time of the write */
+	volatile uint8_t* Sim_TCCR1C(void);
+	#define TCCR1C (*Sim_TCCR1C())
+	extern volatile uint16_t TCNT1, OCR1A, OCR1B, OCR1C, ICR1;
+	extern volatile uint16_t TIFR1;
+	#define WGM10  0
+	#define WGM11  1
+	#define COM1C0 2
+	#define COM1C1 3
+	#define COM1B0 4
+	#define COM1B1 5
+	#define COM1A0 6
+	#define COM1A1 7
+	#define CS10   0
+	#define CS11   1
+	#define CS12   2
+	#define WGM12  3
+	#define WGM13  4
+	#define ICES1  6
+	#define ICNC1  7
+	#define FOC1C  5
+	#define FOC1B  6
+	#define FOC1A  7
+	#define TOIE1  0
+	#define OCIE1A 1
+	#define OCIE1B 2
+	#define OCIE1C 3
+	#define ICIE1  5
+	#define TOV1   0
+	#define OCF1A  1
+	#define OCF1B  2
+	#define OCF1C  3
+	#define ICF1   5
+
+/* TIMER3, only the free-running clk/1 counter */
+	extern volatile uint8_t  TCCR3A, TCCR3B;
+	extern volatile uint16_t TCNT3;
+	#define CS30   0
+
+/* USART1 */
+	extern volatile uint8_t  UCSR1A, UCSR1B, UCSR1C;
+	extern volatile uint16_t UBRR1, UDR1;
+	#define MPCM1   0
+	#define U2X1    1
+	#define UPE1    2
+	#define DOR1    3
+	#define FE1     4
+	#define UDRE1   5
+	#define TXC1    6
+	#define RXC1    7
+	#define TXB81   0
+	#define RXB81   1
+	#define UCSZ12  2
+	#define TXEN1   3
+	#define RXEN1   4
+	#define UDRIE1  5
+	#define TXCIE1  6
+	#define RXCIE1  7
+	#define UCPOL1  0
+	#define UCSZ10  1
+	#define UCSZ11  2
+	#define USBS1   3
+	#define UPM10   4
+	#define UPM11   5
+	#define UMSEL10 6
+	#define UMSEL11 7
+
+	/* Names LUFA/avr-libc also provide for USART0-style code */
+
+/* USB device, interrupt enables and flags: the USB_GEN handler lives in sim/usb.c */
+	extern volatile uint8_t UDIEN;
+	extern volatile uint16_t Sim_USB_Flags;
+	#define UDINT   Sim_USB_Flags
+	#define SUSPE   0
+	#define SOFE    2
+	#define EORSTE  3
+	#define WAKEUPE 4
+	#define EORSME  5
+	#define UPRSME  6
+	#define SUSPI   0
+	#define SOFI    2
+
+/* USB endpoints: UEIENX is the selected endpoint's, UEINT is derived from the endpoint state
+   (sim/usb.c). Only OUT packet interrupts are modelled, control requests are not simulated */
+	volatile uint8_t* Sim_UEIENX(void);
+	uint8_t           Sim_UEINT(void);
+	#define UEIENX  (*Sim_UEIENX())
+	#define UEINT   (Sim_UEINT())
+	#define TXINE   0
+	#define RXOUTE  2
+	#define RXSTPE  3
+
+/* Analog comparator */
+	extern volatile uint8_t ACSR;
+	#define ACD     7
+	#define RXEN0   4
+
+#endif /* _SIM_AVR_IO_H_ */
@@ -0,0 +1,20 @@
+/** \file
+ *
+ *  Host-side stand-in for <avr/pgmspace.h>. The host has a single address space, so flash
+ *  data is ordinary const data and the program space accessors are plain reads.
+ */
+
+#ifndef _SIM_AVR_PGMSPACE_H_
+#define _SIM_AVR_PGMSPACE_H_
+
+	#include <stdint.h>
+	#include <string.h>
+
+	#define PROGMEM
+
+	#define pgm_read_byte(address) (*(const uint8_t*)(address))
+	#define pgm_read_word(address) (*(const uint16_t*)(address))
+	#define pgm_read_ptr(address)  (*(const void* const*)(address))
+	#define memcpy_P(destination, source, length) memcpy(destination, source, length)
+
+#endif /* _SIM_AVR_PGMSPACE_H_ */
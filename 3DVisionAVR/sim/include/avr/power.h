@@ -0,0 +1,19 @@
+/** \file
+ *
+ *  Host-side stand-in for <avr/power.h>; the simulated core always runs at F_CPU.
+ */
+
+#ifndef _SIM_AVR_POWER_H_
+#define _SIM_AVR_POWER_H_
+
+	#define clock_div_1 0
+	#define clock_prescale_set(div) do { (void)(div); } while (0)
+
+	/* Power reduction has no effect on the simulation */
+	#define power_adc_disable()    do { } while (0)
+	#define power_spi_disable()    do { } while (0)
+	#define power_twi_disable()    do { } while (0)
+	#define power_timer0_disable() do { } while (0)
+	#define power_timer3_disable() do { } while (0)
+
+#endif /* _SIM_AVR_POWER_H_ */
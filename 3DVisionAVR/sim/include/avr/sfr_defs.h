@@ -0,0 +1,14 @@
+/** \file
+ *
+ *  Host-side stand-in for <avr/sfr_defs.h>.
+ */
+
+#ifndef _SIM_AVR_SFR_DEFS_H_
+#define _SIM_AVR_SFR_DEFS_H_
+
+	#include "io.h"
+
+	#define bit_is_set(sfr, bit)   ((sfr) & _BV(bit))
+	#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+#endif /* _SIM_AVR_SFR_DEFS_H_ */
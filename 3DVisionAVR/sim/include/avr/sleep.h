@@ -0,0 +1,19 @@
+/** \file
+ *
+ *  Host-side stand-in for <avr/sleep.h>. sleep_cpu() hands the CPU to the simulator until
+ *  an interrupt has been serviced; only idle mode exists, the timers and USB keep running.
+ */
+
+#ifndef _SIM_AVR_SLEEP_H_
+#define _SIM_AVR_SLEEP_H_
+
+	#define SLEEP_MODE_IDLE 0
+
+	void Sim_Sleep(void);
+
+	#define set_sleep_mode(mode) do { (void)(mode); } while (0)
+	#define sleep_enable()       do { } while (0)
+	#define sleep_disable()      do { } while (0)
+	#define sleep_cpu()          Sim_Sleep()
+
+#endif /* _SIM_AVR_SLEEP_H_ */
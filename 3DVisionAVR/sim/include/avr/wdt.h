@@ -0,0 +1,12 @@
+/** \file
+ *
+ *  Host-side stand-in for <avr/wdt.h>; the simulated part has no watchdog.
+ */
+
+#ifndef _SIM_AVR_WDT_H_
+#define _SIM_AVR_WDT_H_
+
+	#define wdt_disable() do { } while (0)
+	#define wdt_reset()   do { } while (0)
+
+#endif /* _SIM_AVR_WDT_H_ */
@@ -0,0 +1,190 @@
+/** \file
+ *
+ *  Replay of recorded host traffic. A capture is a text file with one OUT packet per line:
+ *
+ *      # time_ms  endpoint  data (hex bytes)
+ *      0.000      02        02 22 04 00
+ *      3.125      01        aa fe 00 00 00 00 00 00
+ *
+ *  Times are relative, the replay starts 10ms into the run. The endpoint is the OUT address
+ *  (01 = EMITTER_EP_SWAP_OUT, 02 = EMITTER_EP_CONTROL_OUT) or its name, swap or control.
+ *  Every packet is handed to the simulated host at its time; the bus frame it lands in the
+ *  endpoint bank and the moment the firmware releases it are recorded, along with the IN
+ *  packets the firmware sends back.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "sim.h"
+#include "../Emitter.h"
+
+#define REPLAY_START  SIM_US(10000)
+
+static Sim_ReplayPacket_t* Packets;
+static uint32_t            PacketCount, PacketCapacity;
+static uint32_t            OutCount; // Captured packets, IN packets recorded during the run follow
+static uint32_t            NextPacket;
+static uint64_t            StartAt;
+static bool                Loaded;
+
+static Sim_ReplayPacket_t* Replay_Add(void)
+{
+	if (PacketCount == PacketCapacity)
+	{
+		PacketCapacity = PacketCapacity ? PacketCapacity * 2 : 256;
+		Packets = realloc(Packets, PacketCapacity * sizeof(*Packets));
+		if (!Packets)
+			Sim_Fatal("out of memory");
+	}
+	Sim_ReplayPacket_t* packet = &Packets[PacketCount++];
+	memset(packet, 0, sizeof(*packet));
+	return packet;
+}
+
+/** Reads a capture, returns the run time it needs to play back in ms. Exits on malformed lines */
+uint32_t Sim_Replay_Load(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+		Sim_Fatal("can't open capture %s", path);
+
+	char     line[512];
+	uint32_t number = 0;
+	double   last   = 0;
+	while (fgets(line, sizeof(line), file))
+	{
+		number++;
+		char* hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		char* cursor = line;
+		char* end;
+		double ms = strtod(cursor, &end);
+		if (end == cursor)
+		{
+			while (isspace((unsigned char)*cursor))
+				cursor++;
+			if (*cursor)
+				Sim_Fatal("%s:%u: expected a time in ms", path, number);
+			continue; // Blank or comment
+		}
+		if (ms < last)
+			Sim_Fatal("%s:%u: packets out of time order", path, number);
+		last   = ms;
+		cursor = end;
+
+		char endpoint[16];
+		int  used;
+		if (sscanf(cursor, " %15s%n", endpoint, &used) != 1)
+			Sim_Fatal("%s:%u: expected an endpoint", path, number);
+		cursor += used;
+
+		Sim_ReplayPacket_t* packet = Replay_Add();
+		packet->Time = (uint64_t)(ms * 1000 * SIM_TICKS_PER_US + 0.5);
+		if (!strcmp(endpoint, "swap"))
+			packet->Address = EMITTER_EP_SWAP_OUT;
+		else if (!strcmp(endpoint, "control"))
+			packet->Address = EMITTER_EP_CONTROL_OUT;
+		else
+			packet->Address = strtoul(endpoint, NULL, 16);
+		if (packet->Address != EMITTER_EP_SWAP_OUT && packet->Address != EMITTER_EP_CONTROL_OUT)
+			Sim_Fatal("%s:%u: %s is not an OUT endpoint of the emitter", path, number, endpoint);
+
+		unsigned byte;
+		while (sscanf(cursor, " %2x%n", &byte, &used) == 1)
+		{
+			if (packet->Length == EMITTER_EPSIZE)
+				Sim_Fatal("%s:%u: packet longer than %u bytes", path, number, EMITTER_EPSIZE);
+			packet->Data[packet->Length++] = byte;
+			cursor += used;
+		}
+		while (isspace((unsigned char)*cursor))
+			cursor++;
+		if (*cursor || packet->Length == 0)
+			Sim_Fatal("%s:%u: expected hex data bytes", path, number);
+	}
+	fclose(file);
+
+	if (PacketCount == 0)
+		Sim_Fatal("%s: no packets", path);
+	OutCount = PacketCount;
+	Loaded   = true;
+	return (uint32_t)((REPLAY_START + Packets[PacketCount - 1].Time) / SIM_US(1000)) + 1;
+}
+
+bool Sim_Replay_Active(void)
+{
+	return Loaded;
+}
+
+void Sim_Replay_Start(void)
+{
+	StartAt = Sim_Now + REPLAY_START;
+	for (uint32_t i = 0; i < OutCount; i++)
+		Packets[i].Time += StartAt;
+}
+
+/** Hands packets that are due to the simulated host */
+void Sim_Replay_Tick(void)
+{
+	while (Loaded && NextPacket < OutCount && Packets[NextPacket].Time <= Sim_Now)
+	{
+		Sim_ReplayPacket_t* packet = &Packets[NextPacket];
+		Sim_USB_QueueOUT(packet->Address, packet->Data, packet->Length, NextPacket);
+		NextPacket++;
+	}
+}
+
+void Sim_Replay_Delivered(int32_t tag)
+{
+	Packets[tag].Delivered = Sim_Now;
+}
+
+void Sim_Replay_Processed(int32_t tag)
+{
+	Packets[tag].Processed = Sim_Now;
+}
+
+/** Records an IN packet the firmware committed, part of the replay timeline */
+void Sim_Replay_ReceiveIN(uint8_t address, const uint8_t* data, uint8_t length)
+{
+	if (!Loaded)
+		return;
+	Sim_ReplayPacket_t* packet = Replay_Add();
+	packet->Time      = Sim_Now;
+	packet->Delivered = Sim_Now;
+	packet->Processed = Sim_Now;
+	packet->Address   = address;
+	packet->Length    = length;
+	memcpy(packet->Data, data, length);
+}
+
+static int Replay_Compare(const void* a, const void* b)
+{
+	const Sim_ReplayPacket_t* first  = a;
+	const Sim_ReplayPacket_t* second = b;
+	if (first->Time != second->Time)
+		return (first->Time < second->Time) ? -1 : 1;
+	return (int)(first->Address & ENDPOINT_DIR_IN) - (int)(second->Address & ENDPOINT_DIR_IN);
+}
+
+/** Puts the IN packets recorded during the run in time order with the captured ones */
+void Sim_Replay_Finish(void)
+{
+	Loaded = false; // Tags are no longer valid
+	if (PacketCount)
+		qsort(Packets, PacketCount, sizeof(*Packets), Replay_Compare);
+}
+
+uint32_t Sim_Replay_Count(void)
+{
+	return PacketCount;
+}
+
+const Sim_ReplayPacket_t* Sim_Replay_Packet(uint32_t index)
+{
+	return &Packets[index];
+}
@@ -0,0 +1,1615 @@
+/** \file
+ *
+ *  Host-side cycle-level simulator for the emitter firmware.
+ *
+ *  The firmware sources are compiled unmodified against the register stand-ins in
+ *  sim/include. Time advances in Timer1 ticks (0.5us); on every tick the simulator steps
+ *  the timers, the USART and the stimulus (VESA sync signal, driver swap packets), then
+ *  dispatches pending interrupts by hardware priority. The firmware main loop runs in
+ *  between: every USB_USBTask() call hands the CPU back to the simulator for one loop
+ *  iteration's worth of ticks.
+ *
+ *  Recorded host traffic can take the place of the generated swap packets, see replay.c.
+ *
+ *  Pin activity is written to a VCD file and summarised on exit: sync-to-first-pulse
+ *  latency, frame interval spread and pulse edge error against the protocol table.
+ */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "sim.h"
+#include "../Emitter.h"
+#include "../Profile.h"
+
+/* Register file */
+volatile uint8_t  SREG, MCUSR;
+volatile uint8_t  PINB, DDRB, PORTB;
+volatile uint8_t  PINC, DDRC, PORTC;
+volatile uint8_t  PIND, DDRD, PORTD;
+volatile uint8_t  PINE, DDRE, PORTE;
+volatile uint8_t  PINF, DDRF, PORTF;
+volatile uint8_t  EICRA, EICRB, EIMSK;
+volatile uint16_t EIFR;
+volatile uint8_t  TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0;
+volatile uint16_t TIFR0;
+volatile uint8_t  TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t TCNT1, OCR1A, OCR1B, OCR1C, ICR1;
+volatile uint16_t TIFR1;
+volatile uint8_t  TCCR3A, TCCR3B;
+volatile uint16_t TCNT3;
+volatile uint8_t  UCSR1A, UCSR1B, UCSR1C;
+volatile uint16_t UBRR1, UDR1;
+volatile uint8_t  ACSR;
+
+/* Firmware entry point, Emitter.c is built with main renamed */
+int Emitter_Main(void);
+
+Sim_Config_t Sim_Config = {
+	.SyncMode    = SYNCMODE_COMBINED,
+	.RefreshRate = 120.0,
+	.DurationMS  = 1000,
+	.UsbDelayUS  = 300,
+	.UsbJitterUS = 500,
+	.UsbClockPPM = 0,
+	.LoopTicks   = 10,
+	.IsrLatency  = 2,
+	.ForcePin    = true,
+	.Flywheel    = -1,
+	.LeadUS      = SIM_LEAD_KEEP,
+	.Seed        = 1,
+};
+
+uint64_t Sim_Now;
+
+/* Weak fallbacks for vectors the firmware doesn't implement */
+#define SIM_DEFAULT_VECTOR(name) \
+	void __attribute__((weak)) Sim_Vect_##name(void) { Sim_Fatal("BADISR: " #name " enabled without a handler"); }
+
+SIM_DEFAULT_VECTOR(INT0)
+SIM_DEFAULT_VECTOR(INT1)
+void Sim_Vect_USB_GEN(void);
+SIM_DEFAULT_VECTOR(USB_COM)
+SIM_DEFAULT_VECTOR(TIMER1_CAPT)
+SIM_DEFAULT_VECTOR(TIMER1_COMPA)
+SIM_DEFAULT_VECTOR(TIMER1_COMPB)
+SIM_DEFAULT_VECTOR(TIMER1_COMPC)
+SIM_DEFAULT_VECTOR(TIMER1_OVF)
+SIM_DEFAULT_VECTOR(TIMER0_COMPA)
+SIM_DEFAULT_VECTOR(TIMER0_COMPB)
+SIM_DEFAULT_VECTOR(TIMER0_OVF)
+SIM_DEFAULT_VECTOR(USART1_UDRE)
+SIM_DEFAULT_VECTOR(USART1_TX)
+
+/* Interrupt sources in hardware priority order (lowest vector number first) */
+typedef struct
+{
+	const char*        Name;
+	void             (*Handler)(void);
+	volatile uint8_t*  EnableReg;
+	uint8_t            EnableBit;
+	volatile uint16_t* FlagReg;
+	uint8_t            FlagBit;
+	bool               ClearOnEntry; /**< False for level sources such as UDRE */
+	uint8_t            Ticks;        /**< Handler body + epilogue, in ticks */
+} Sim_Vector_t;
+
+static volatile uint16_t UartFlags; /**< TXC1/UDRE1, mirrored into UCSR1A */
+
+static const Sim_Vector_t Vectors[] = {
+	{ "INT0",         Sim_Vect_INT0,         &EIMSK,  INT0,   &EIFR,      INTF0,  true,  3 },
+	{ "INT1",         Sim_Vect_INT1,         &EIMSK,  INT1,   &EIFR,      INTF1,  true,  6 },
+	{ "USB_GEN",      Sim_Vect_USB_GEN,      &UDIEN,  SOFE,   &Sim_USB_Flags, SOFI, true, 12 },
+	{ "USB_COM",      Sim_Vect_USB_COM,      &Sim_USB_ComEnable, 0, &Sim_USB_ComFlags, 0, false, 6 },
+	{ "TIMER1_CAPT",  Sim_Vect_TIMER1_CAPT,  &TIMSK1, ICIE1,  &TIFR1,     ICF1,   true,  4 },
+	{ "TIMER1_COMPA", Sim_Vect_TIMER1_COMPA, &TIMSK1, OCIE1A, &TIFR1,     OCF1A,  true,  3 },
+	{ "TIMER1_COMPB", Sim_Vect_TIMER1_COMPB, &TIMSK1, OCIE1B, &TIFR1,     OCF1B,  true,  4 },
+	{ "TIMER1_COMPC", Sim_Vect_TIMER1_COMPC, &TIMSK1, OCIE1C, &TIFR1,     OCF1C,  true,  4 },
+	{ "TIMER1_OVF",   Sim_Vect_TIMER1_OVF,   &TIMSK1, TOIE1,  &TIFR1,     TOV1,   true,  2 },
+	{ "TIMER0_COMPA", Sim_Vect_TIMER0_COMPA, &TIMSK0, OCIE0A, &TIFR0,     OCF0A,  true,  2 },
+	{ "TIMER0_COMPB", Sim_Vect_TIMER0_COMPB, &TIMSK0, OCIE0B, &TIFR0,     OCF0B,  true,  2 },
+	{ "TIMER0_OVF",   Sim_Vect_TIMER0_OVF,   &TIMSK0, TOIE0,  &TIFR0,     TOV0,   true,  3 },
+	{ "USART1_UDRE",  Sim_Vect_USART1_UDRE,  &UCSR1B, UDRIE1, &UartFlags, UDRE1,  false, 3 },
+	{ "USART1_TX",    Sim_Vect_USART1_TX,    &UCSR1B, TXCIE1, &UartFlags, TXC1,   true,  3 },
+};
+#define SIM_VECTORS (sizeof(Vectors) / sizeof(Vectors[0]))
+
+/* Write-one-to-clear flag registers, see the note in include/avr/io.h */
+static volatile uint16_t* const FlagRegs[] = { &EIFR, &TIFR0, &TIFR1 };
+#define SIM_FLAGREGS (sizeof(FlagRegs) / sizeof(FlagRegs[0]))
+#define SIM_PARKED   0x100
+
+static uint8_t  ParkedFlags[SIM_FLAGREGS];
+static uint8_t  ParkedUCSR1A;
+static uint16_t ParkedTCNT1;
+
+/* CPU state */
+static int8_t   ActiveVector = -1;  /**< Vector whose handler is about to run, -1 if none */
+static uint64_t HandlerAt;          /**< Tick at which the active vector's body executes */
+static uint64_t CpuFreeAt;          /**< End of the current handler; main code is stalled until then */
+static bool     Started;
+static bool     Sleeping;           /**< In sleep_cpu(), the next interrupt wakes the CPU */
+static uint64_t SleepTicks;
+
+/* Peripheral state */
+static uint8_t  Timer0Prescale;
+static uint8_t  Timer1Prescale;
+static bool     Timer1WriteBlock;
+static bool     OC1[3];
+static uint8_t  RegTCCR1C;
+static uint8_t  ForceCom;           /**< TCCR1A when TCCR1C was last accessed */
+
+static uint8_t  ExtPIND = 0xFF;      /**< Externally driven levels on port D inputs */
+
+/* Port D pin the VESA sync signal is wired to */
+#ifdef SYNC_ICP
+	#define SIM_SYNC_BIT SYNCIN_ICP
+#else
+	#define SIM_SYNC_BIT SYNCIN
+#endif
+#define SIM_ICP1_BIT 4
+
+static int      UartShift = -1;     /**< Byte in the transmit shift register, -1 when idle */
+static int      UartBuffer = -1;    /**< Byte waiting in UDR1, -1 when empty */
+static uint32_t UartBitsLeft;
+static uint32_t UartBitTicks;
+static FILE*    UartFile;
+
+/* EEPROM */
+#define SIM_EEPROM_WRITE SIM_US(3400)  /**< Erase + write time of one byte */
+static uint8_t  Eeprom[E2END + 1];
+static uint64_t EepromBusyUntil;
+static uint32_t EepromWrites;
+
+volatile uint8_t* Sim_TCCR1C(void)
+{
+	ForceCom = TCCR1A;
+	return &RegTCCR1C;
+}
+
+/* Stimulus */
+static double   FramePeriod;        /**< Display frame period in ticks */
+static uint64_t FirstFrameAt;
+static bool     SyncLevel;              /**< VESA sync level without the noise */
+static uint64_t GlitchAt, GlitchEnd;    /**< Next noise pulse, end of the current one */
+static uint32_t NextFrame;
+static uint32_t Random;
+
+typedef struct
+{
+	uint64_t Time;
+	uint8_t  Eye;
+} Sim_Frame_t;
+
+typedef struct
+{
+	uint64_t Time;
+	uint8_t  Eye;
+} Sim_PendingPacket_t;
+
+static Sim_PendingPacket_t Packets[16];
+static uint8_t             PacketCount;
+
+/* Statistics received on EMITTER_EP_STATS_IN */
+static uint8_t  StatsPages[STATS_PAGES][SIM_MAX_PACKET]; /**< Latest snapshot */
+static uint32_t StatsSnapshots;
+
+/* ISR profile, CMD_PROFILE replies on EMITTER_EP_CONTROL_IN: one per vector, then the main loop */
+#define SIM_PROFILE_READ SIM_US(10000) /**< Read this long before the end */
+static const char* const ProfileNames[PROFILE_VECTORS] = {
+	"TIMER1_COMPA", "TIMER1_COMPB", "TIMER1_COMPC", "TIMER1_CAPT", "TIMER1_OVF",
+	"INT1", "USART1_UDRE", "USB_COM", "USB SOF",
+};
+static uint8_t  ProfileReplies[PROFILE_VECTORS + 1][SIM_MAX_PACKET];
+static uint16_t ProfileReceived; /**< One bit per reply */
+static uint8_t  ProfileStep;     /**< 0: clear at the end of the warm-up, 1: read, 2: done */
+
+/* Recorded activity */
+typedef struct
+{
+	uint64_t Time;
+	bool     Level;
+} Sim_Edge_t;
+
+static Sim_Frame_t* Frames;
+static uint32_t     FrameCount, FrameCapacity;
+static Sim_Edge_t*  IrEdges;
+static uint32_t     IrEdgeCount, IrEdgeCapacity;
+
+/* Traced signals */
+typedef struct
+{
+	const char* Name;
+	char        Id;
+	bool        Level;
+	uint64_t    PulseEnd; /**< Markers only: end of the single tick pulse */
+} Sim_Signal_t;
+
+enum
+{
+	SIGNAL_IR = 0,
+	SIGNAL_EYE,
+	SIGNAL_ACTIVE,
+	SIGNAL_SYNC,
+	SIGNAL_MARKERS,
+	SIGNAL_COUNT = SIGNAL_MARKERS + SIM_MARKER_Count
+};
+
+static Sim_Signal_t Signals[SIGNAL_COUNT] = {
+	[SIGNAL_IR]      = { "ir_led",     '!' },
+	[SIGNAL_EYE]     = { "eye_led_n",  '"' },
+	[SIGNAL_ACTIVE]  = { "active_led", '#' },
+	[SIGNAL_SYNC]    = { "sync_in",    '$' },
+	[SIGNAL_MARKERS + SIM_MARKER_SwapPacket] = { "swap_packet", '%' },
+	[SIGNAL_MARKERS + SIM_MARKER_SOF]        = { "usb_sof",     '&' },
+};
+
+static FILE* VcdFile;
+
+static void Sim_Finish(void) __attribute__((noreturn));
+
+void Sim_Fatal(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "sim: %.1f us: ", Sim_Now / (double)SIM_TICKS_PER_US);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+	exit(2);
+}
+
+static void* Sim_Grow(void* array, uint32_t* capacity, size_t element)
+{
+	*capacity = *capacity ? *capacity * 2 : 1024;
+	array = realloc(array, *capacity * element);
+	if (!array)
+		Sim_Fatal("out of memory");
+	return array;
+}
+
+static uint32_t Sim_Random(void)
+{
+	Random = Random * 1103515245u + 12345u;
+	return (Random >> 8) & 0xFFFFFF;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Pins and trace output                                                      */
+/* ------------------------------------------------------------------------- */
+
+/** Level driven onto a port pin, taking compare output overrides into account */
+static bool Pin_Output(volatile uint8_t* port, uint8_t bit)
+{
+	if (port == &PORTB && bit >= 5)
+	{
+		uint8_t com = (TCCR1A >> (COM1A0 - 2 * (bit - 5))) & 3;
+		if (com)
+			return OC1[bit - 5];
+	}
+	return (*port >> bit) & 1;
+}
+
+static void Pins_Update(void)
+{
+	PINB = PORTB & DDRB;
+	for (uint8_t bit = 5; bit < 8; bit++)
+	{
+		if (Pin_Output(&PORTB, bit))
+			PINB |= _BV(bit);
+		else
+			PINB &= ~_BV(bit);
+	}
+	PINC = PORTC & DDRC;
+	PIND = (PORTD & DDRD) | (ExtPIND & ~DDRD);
+	PINE = PORTE & DDRE;
+	PINF = PORTF & DDRF;
+}
+
+static void Vcd_Change(uint8_t signal, bool level)
+{
+	Signals[signal].Level = level;
+	if (VcdFile)
+		fprintf(VcdFile, "#%llu\n%d%c\n", (unsigned long long)(Sim_Now * 5), level, Signals[signal].Id);
+}
+
+static void Signal_Set(uint8_t signal, bool level)
+{
+	if (Signals[signal].Level == level)
+		return;
+	Vcd_Change(signal, level);
+
+	if (signal == SIGNAL_IR)
+	{
+		if (IrEdgeCount == IrEdgeCapacity)
+			IrEdges = Sim_Grow(IrEdges, &IrEdgeCapacity, sizeof(*IrEdges));
+		IrEdges[IrEdgeCount++] = (Sim_Edge_t){ Sim_Now, level };
+	}
+}
+
+void Sim_Marker(uint8_t marker)
+{
+	Sim_Signal_t* signal = &Signals[SIGNAL_MARKERS + marker];
+	if (!signal->Level)
+		Vcd_Change(SIGNAL_MARKERS + marker, true);
+	signal->PulseEnd = Sim_Now + 1;
+}
+
+static void Signals_Sample(void)
+{
+	Pins_Update();
+#ifdef IR_HW_PULSE
+	Signal_Set(SIGNAL_IR,     Pin_Output(&PORT_LED_IR_OC, LED_IR_OC));
+#else
+	Signal_Set(SIGNAL_IR,     Pin_Output(&PORT_LED_IR, LED_IR));
+#endif
+	Signal_Set(SIGNAL_EYE,    Pin_Output(&PORT_LED_EYE, LED_EYE));
+	Signal_Set(SIGNAL_ACTIVE, Pin_Output(&PORT_LED_ACTIVE, LED_ACTIVE));
+	Signal_Set(SIGNAL_SYNC,   (PIND >> SIM_SYNC_BIT) & 1);
+
+	for (uint8_t i = SIGNAL_MARKERS; i < SIGNAL_COUNT; i++)
+	{
+		if (Signals[i].Level && Sim_Now >= Signals[i].PulseEnd)
+			Vcd_Change(i, false);
+	}
+}
+
+static void Vcd_Open(const char* path)
+{
+	VcdFile = fopen(path, "w");
+	if (!VcdFile)
+		Sim_Fatal("can't open %s", path);
+
+	fprintf(VcdFile, "$comment 3DVisionAVR simulator, protocol %s $end\n", Sim_Config.Protocol ? Sim_Config.Protocol : "stored");
+	fprintf(VcdFile, "$timescale 100ns $end\n$scope module emitter $end\n");
+	for (uint8_t i = 0; i < SIGNAL_COUNT; i++)
+		fprintf(VcdFile, "$var wire 1 %c %s $end\n", Signals[i].Id, Signals[i].Name);
+	fprintf(VcdFile, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+	for (uint8_t i = 0; i < SIGNAL_COUNT; i++)
+		fprintf(VcdFile, "%d%c\n", Signals[i].Level, Signals[i].Id);
+	fprintf(VcdFile, "$end\n");
+}
+
+/* ------------------------------------------------------------------------- */
+/* Firmware register access                                                   */
+/* ------------------------------------------------------------------------- */
+
+/** Prepares the register file before firmware code runs */
+static void Regs_Park(void)
+{
+	for (uint8_t i = 0; i < SIM_FLAGREGS; i++)
+	{
+		ParkedFlags[i] = *FlagRegs[i] & 0xFF;
+		*FlagRegs[i]   = ParkedFlags[i] | SIM_PARKED;
+	}
+
+	UCSR1A = (UCSR1A & ~(_BV(TXC1) | _BV(UDRE1))) | UartFlags;
+	ParkedUCSR1A = UCSR1A;
+	UDR1 = SIM_PARKED;
+	ParkedTCNT1 = TCNT1;
+}
+
+static void Uart_Write(uint8_t data);
+
+/** Applies the side effects of firmware register writes */
+static void Regs_Collect(void)
+{
+	for (uint8_t i = 0; i < SIM_FLAGREGS; i++)
+	{
+		uint16_t value = *FlagRegs[i];
+		uint16_t flags = ParkedFlags[i];
+		if (value != (flags | SIM_PARKED))
+			flags &= ~(value & 0xFF); // write one to clear
+		*FlagRegs[i] = flags;
+	}
+
+	if ((UCSR1A != ParkedUCSR1A) && (UCSR1A & _BV(TXC1)))
+		UartFlags &= ~_BV(TXC1);
+	UCSR1A = (UCSR1A & ~(_BV(TXC1) | _BV(UDRE1))) | UartFlags;
+
+	if (UDR1 != SIM_PARKED)
+		Uart_Write(UDR1 & 0xFF);
+
+	if (TCNT1 != ParkedTCNT1)
+		Timer1WriteBlock = true;
+
+	if (RegTCCR1C & (_BV(FOC1A) | _BV(FOC1B) | _BV(FOC1C)))
+	{
+		for (uint8_t ch = 0; ch < 3; ch++)
+		{
+			if (!(RegTCCR1C & _BV(FOC1A - ch)))
+				continue;
+			uint8_t com = (ForceCom >> (COM1A0 - 2 * ch)) & 3;
+			OC1[ch] = (com == 1) ? !OC1[ch] : (com == 3);
+		}
+		RegTCCR1C &= ~(_BV(FOC1A) | _BV(FOC1B) | _BV(FOC1C));
+	}
+
+	/* Ticks per timer count for each clock select value, 0xFF where unsupported */
+	static const uint8_t Prescalers[8] = { 0, 0xFF, 1, 8, 32, 128, 0xFF, 0xFF };
+	Timer0Prescale = Prescalers[TCCR0B & 7];
+	Timer1Prescale = Prescalers[TCCR1B & 7];
+	if (Timer0Prescale == 0xFF || Timer1Prescale == 0xFF || (TCCR3B & 7) > 1 || TCCR3A)
+		Sim_Fatal("unsupported timer clock source");
+
+	if (UCSR1B & _BV(TXEN1))
+		UartBitTicks = (UBRR1 + 1) * ((UCSR1A & _BV(U2X1)) ? 8 : 16) / SIM_CYCLES_PER_TICK;
+
+	Signals_Sample();
+}
+
+/** Runs a piece of firmware code with write side effects applied afterwards */
+static void Firmware_Run(void (*code)(void))
+{
+	Regs_Park();
+	code();
+	Regs_Collect();
+}
+
+/* ------------------------------------------------------------------------- */
+/* Peripherals                                                                */
+/* ------------------------------------------------------------------------- */
+
+static void Timer0_Count(void)
+{
+	uint8_t mode = (TCCR0A & 3) | ((TCCR0B >> 1) & 4);
+	if (mode == 1 || mode == 5)
+		Sim_Fatal("timer0 phase correct PWM not supported");
+
+	uint8_t top = (mode == 2 || mode == 7) ? OCR0A : 0xFF;
+	if (TCNT0 == top)
+	{
+		TCNT0 = 0;
+		if (mode == 0 || (mode == 2 && top == 0xFF))
+			TIFR0 |= _BV(TOV0);
+	}
+	else
+	{
+		TCNT0++;
+	}
+
+	if (TCNT0 == OCR0A)
+		TIFR0 |= _BV(OCF0A);
+	if (TCNT0 == OCR0B)
+		TIFR0 |= _BV(OCF0B);
+	if ((mode == 3 || mode == 7) && TCNT0 == top)
+		TIFR0 |= _BV(TOV0);
+}
+
+static void Timer1_Count(void)
+{
+	uint8_t  mode = (TCCR1A & 3) | ((TCCR1B >> 1) & 0x0C);
+	uint16_t top;
+	if (mode == 0)
+		top = 0xFFFF;
+	else if (mode == 4)
+		top = OCR1A;
+	else if (mode == 12)
+		top = ICR1;
+	else
+		Sim_Fatal("timer1 waveform mode %u not supported", mode);
+
+	if (TCNT1 == top)
+	{
+		TCNT1 = 0;
+		if (top == 0xFFFF)
+			TIFR1 |= _BV(TOV1);
+	}
+	else
+	{
+		TCNT1++;
+	}
+
+	if (Timer1WriteBlock)
+	{
+		Timer1WriteBlock = false;
+		return;
+	}
+
+	volatile uint16_t* const ocr[3] = { &OCR1A, &OCR1B, &OCR1C };
+	for (uint8_t ch = 0; ch < 3; ch++)
+	{
+		if (TCNT1 != *ocr[ch])
+			continue;
+		TIFR1 |= _BV(OCF1A + ch);
+
+		uint8_t com = (TCCR1A >> (COM1A0 - 2 * ch)) & 3;
+		if (com == 1)
+			OC1[ch] = !OC1[ch];
+		else if (com)
+			OC1[ch] = (com == 3);
+	}
+}
+
+static void Timers_Tick(void)
+{
+	static uint8_t t0Div, t1Div;
+
+	if (Timer0Prescale && (++t0Div >= Timer0Prescale))
+	{
+		t0Div = 0;
+		Timer0_Count();
+	}
+	if (Timer1Prescale && (++t1Div >= Timer1Prescale))
+	{
+		t1Div = 0;
+		Timer1_Count();
+	}
+	if (TCCR3B & _BV(CS30))
+		TCNT3 += SIM_CYCLES_PER_TICK;
+}
+
+static void Uart_Write(uint8_t data)
+{
+	if (!(UCSR1B & _BV(TXEN1)))
+		return;
+
+	if (UartShift < 0)
+	{
+		UartShift    = data;
+		UartBitsLeft = 10 * UartBitTicks;
+		UartFlags   &= ~_BV(TXC1);
+	}
+	else if (UartBuffer < 0)
+	{
+		UartBuffer = data;
+		UartFlags &= ~_BV(UDRE1);
+	}
+	else
+	{
+		Sim_Fatal("UDR1 written while full, byte 0x%02X lost", data);
+	}
+}
+
+static void Uart_Tick(void)
+{
+	if (UartShift < 0 || --UartBitsLeft)
+		return;
+
+	if (UartFile)
+		fputc(UartShift, UartFile);
+
+	UartShift = -1;
+	if (UartBuffer >= 0)
+	{
+		UartShift    = UartBuffer;
+		UartBuffer   = -1;
+		UartBitsLeft = 10 * UartBitTicks;
+		UartFlags   |= _BV(UDRE1);
+	}
+	else
+	{
+		UartFlags |= _BV(TXC1);
+	}
+}
+
+/** Drives an external level onto a port D input, raising edge interrupt flags */
+static void Input_Set(uint8_t bit, bool level)
+{
+	uint8_t mask = _BV(bit);
+	bool    last = (ExtPIND & mask) != 0;
+	if (level == last)
+		return;
+	ExtPIND = level ? (ExtPIND | mask) : (ExtPIND & ~mask);
+
+	if (DDRD & mask)
+		return;
+
+	/* INT0..INT3 sit on PD0..PD3 */
+	if (bit < 4)
+	{
+		uint8_t isc = (EICRA >> (2 * bit)) & 3;
+		if ((isc == 1) || (isc == 2 && !level) || (isc == 3 && level))
+			EIFR |= _BV(INTF0 + bit);
+	}
+
+	/* ICP1 latches TCNT1 on the selected edge. The synchroniser and noise canceller delay
+	   the capture by a few cycles, which lands on the count this tick is about to make */
+	if (bit == SIM_ICP1_BIT && level == !!(TCCR1B & _BV(ICES1)))
+	{
+		ICR1   = TCNT1 + 1;
+		TIFR1 |= _BV(ICF1);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* EEPROM                                                                     */
+/* ------------------------------------------------------------------------- */
+
+static uint8_t* Eeprom_Byte(const void* address)
+{
+	uintptr_t index = (uintptr_t)address;
+	if (index > E2END)
+		Sim_Fatal("EEPROM access past the end at %04lX", (unsigned long)index);
+	return &Eeprom[index];
+}
+
+bool eeprom_is_ready(void)
+{
+	return Sim_Now >= EepromBusyUntil;
+}
+
+uint8_t eeprom_read_byte(const uint8_t* address)
+{
+	return *Eeprom_Byte(address);
+}
+
+void eeprom_read_block(void* destination, const void* source, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+		((uint8_t*)destination)[i] = *Eeprom_Byte((const uint8_t*)source + i);
+}
+
+void eeprom_update_byte(uint8_t* address, uint8_t value)
+{
+	while (!eeprom_is_ready())
+		Sim_Yield(1); // avr-libc spins on EEPE
+
+	uint8_t* cell = Eeprom_Byte(address);
+	if (*cell != value)
+	{
+		*cell = value;
+		EepromBusyUntil = Sim_Now + SIM_EEPROM_WRITE;
+		EepromWrites++;
+	}
+}
+
+static void Eeprom_Load(const char* path)
+{
+	memset(Eeprom, 0xFF, sizeof(Eeprom)); // Erased
+	FILE* file = path ? fopen(path, "rb") : NULL;
+	if (file)
+	{
+		if (fread(Eeprom, 1, sizeof(Eeprom), file) == 0 && ferror(file))
+			Sim_Fatal("can't read %s", path);
+		fclose(file);
+	}
+}
+
+static void Eeprom_Save(const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if (!file || fwrite(Eeprom, 1, sizeof(Eeprom), file) != sizeof(Eeprom))
+		Sim_Fatal("can't write %s", path);
+	fclose(file);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Stimulus                                                                   */
+/* ------------------------------------------------------------------------- */
+
+/* Host side of CMD_PROTOCOL_WRITE / CMD_PROTOCOL_COMMIT */
+static void Stimulus_Upload(const char* name)
+{
+	uint8_t image[IR_IMAGE_MAX];
+	uint8_t length = Sim_ProtocolImage(name, image);
+	const uint8_t chunk = EMITTER_EPSIZE - 4;
+
+	for (uint8_t offset = 0; offset < length; offset += chunk)
+	{
+		uint8_t packet[EMITTER_EPSIZE] = { CMD_PROTOCOL_WRITE, offset };
+		packet[2] = (length - offset) < chunk ? (length - offset) : chunk;
+		memcpy(packet + 4, image + offset, packet[2]);
+		Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, packet, 4 + packet[2], -1);
+	}
+	uint8_t commit[4] = { CMD_PROTOCOL_COMMIT, 0, length };
+	Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, commit, sizeof(commit), -1);
+}
+
+/* Built-in protocol IDs of a comma separated list, returns how many or -1 on an unknown name */
+static int Mix_Parse(const char* list, uint8_t* ids, uint8_t max)
+{
+	char names[128];
+	int  count = 0;
+	snprintf(names, sizeof(names), "%s", list);
+	for (char* name = strtok(names, ","); name; name = strtok(NULL, ","))
+	{
+		int id = Sim_ProtocolID(name);
+		if (id < 0 || count == max)
+			return -1;
+		ids[count++] = id;
+	}
+	return count;
+}
+
+/* Host side of CMD_PROTOCOL_MIX */
+static void Stimulus_Mix(const char* list)
+{
+	uint8_t packet[EMITTER_EPSIZE] = { CMD_PROTOCOL_MIX, 0 };
+	packet[2] = Mix_Parse(list, packet + 4, EMITTER_EPSIZE - 4);
+	Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, packet, 4 + packet[2], -1);
+}
+
+/* Host side of EMITTER_EP_STATS_IN, keeps the latest statistics snapshot, and of the
+   CMD_PROFILE replies on EMITTER_EP_CONTROL_IN */
+void Sim_ReceiveIN(uint8_t address, const uint8_t* data, uint8_t length)
+{
+	if (address == EMITTER_EP_CONTROL_IN && length >= 4 && data[0] == CMD_PROFILE && data[1] <= PROFILE_VECTORS && ProfileStep == 2)
+	{
+		memcpy(ProfileReplies[data[1]], data, length);
+		ProfileReceived |= 1 << data[1];
+		return;
+	}
+	if (address != EMITTER_EP_STATS_IN || length < 4 || data[0] != STATS_TAG || data[1] >= STATS_PAGES)
+		return;
+	memcpy(StatsPages[data[1]], data, length);
+	if (data[1] == (STATS_PAGES - 1) && StatsPages[0][2] == data[2])
+		StatsSnapshots++;
+}
+
+static uint32_t Stats_Read(uint8_t page, uint8_t offset, uint8_t size)
+{
+	uint32_t value = 0;
+	while (size--)
+		value = (value << 8) | StatsPages[page][4 + offset + size];
+	return value;
+}
+
+static uint32_t Profile_Value(uint8_t vector, uint8_t offset, uint8_t size)
+{
+	uint32_t value = 0;
+	while (size--)
+		value = (value << 8) | ProfileReplies[vector][4 + offset + size];
+	return value;
+}
+
+/* Host side of CMD_PROFILE: clears the profile once the warm-up is over, reads it back near the end */
+static void Stimulus_Profile(void)
+{
+	uint64_t end = SIM_US(Sim_Config.DurationMS * 1000ULL);
+	if (ProfileStep == 0 && Sim_Now >= SIM_US(Sim_Config.WarmupMS * 1000ULL))
+	{
+		if (Sim_Config.WarmupMS)
+			Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, (uint8_t[4]){ CMD_PROFILE, PROFILE_VECTORS, 1 }, 4, -1);
+		ProfileStep = 1;
+	}
+	else if (ProfileStep == 1 && Sim_Now + SIM_PROFILE_READ >= end)
+	{
+		for (uint8_t i = 0; i <= PROFILE_VECTORS; i++)
+			Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, (uint8_t[4]){ CMD_PROFILE, i }, 4, -1);
+		ProfileStep = 2;
+	}
+}
+
+static void Stimulus_Start(void)
+{
+	FramePeriod  = (SIM_TICKS_PER_US * 1e6) / Sim_Config.RefreshRate;
+	FirstFrameAt = Sim_Now + SIM_US(10000);
+	Random       = Sim_Config.Seed;
+
+	if (Sim_Config.Upload)
+		Stimulus_Upload(Sim_Config.Upload);
+	if (Sim_Config.Mix)
+		Stimulus_Mix(Sim_Config.Mix);
+	if (Sim_Config.SyncMode == SYNCMODE_FREERUN)
+	{
+		uint32_t rate = llround(Sim_Config.RefreshRate * 1000); // Free-run at the simulated display rate
+		Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, (uint8_t[8]){ CMD_FREERUN_RATE, 0, 4, 0, rate, rate >> 8, rate >> 16, rate >> 24 }, 8, -1);
+	}
+	if (Sim_Replay_Active())
+		Sim_Replay_Start();
+	if (Sim_Config.StatsRate)
+		Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, (uint8_t[4]){ CMD_STATS_RATE, Sim_Config.StatsRate }, 4, -1);
+	if (Sim_Config.Flywheel >= 0)
+		Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, (uint8_t[4]){ CMD_FLYWHEEL, Sim_Config.Flywheel }, 4, -1);
+	if (Sim_Config.LeadUS != SIM_LEAD_KEEP)
+		Sim_USB_QueueOUT(EMITTER_EP_CONTROL_OUT, (uint8_t[6]){ CMD_PROTOCOL_LEAD, 0, 2, 0, Sim_Config.LeadUS, (uint16_t)Sim_Config.LeadUS >> 8 }, 6, -1);
+}
+
+static void Stimulus_Tick(void)
+{
+	if (Sim_Config.Profile)
+		Stimulus_Profile();
+
+	uint64_t frameAt = FirstFrameAt + (uint64_t)llround(NextFrame * FramePeriod);
+	if (Sim_Now >= frameAt)
+	{
+		/* VESA sync: high = left eye, frames alternate starting with the left eye */
+		uint8_t eye = (NextFrame & 1) ? EYE_RIGHT : EYE_LEFT;
+		NextFrame++;
+
+		if (FrameCount == FrameCapacity)
+			Frames = Sim_Grow(Frames, &FrameCapacity, sizeof(*Frames));
+		Frames[FrameCount++] = (Sim_Frame_t){ Sim_Now, eye };
+
+		/* Dropout: the cable or the driver stalls halfway through every second, the display goes on */
+		uint64_t second = (Sim_Now - FirstFrameAt) % SIM_US(1000000);
+		bool dropped = second >= SIM_US(500000) && second < SIM_US(500000 + Sim_Config.DropoutMS * 1000);
+
+		/* Slip: the host falls a frame behind with its packets for a while, the display doesn't */
+		bool slipped = second >= SIM_US(250000) && second < SIM_US(250000 + Sim_Config.SlipMS * 1000);
+
+		SyncLevel = eye == EYE_LEFT;
+		if ((Sim_Config.SyncMode & SYNCMODE_EXTERNAL) && !dropped)
+			Input_Set(SIM_SYNC_BIT, SyncLevel);
+
+		if ((Sim_Config.SyncMode & SYNCMODE_DRIVER) && !Sim_Replay_Active() && !dropped && PacketCount < sizeof(Packets) / sizeof(Packets[0]))
+		{
+			uint64_t delay = SIM_US(Sim_Config.UsbDelayUS);
+			if (Sim_Config.UsbJitterUS)
+				delay += Sim_Random() % SIM_US(Sim_Config.UsbJitterUS);
+			if (slipped)
+				delay += (uint64_t)llround(FramePeriod);
+
+			/* Bulk packets on one pipe can't overtake each other */
+			uint64_t at = Sim_Now + delay;
+			if (PacketCount && at <= Packets[PacketCount - 1].Time)
+				at = Packets[PacketCount - 1].Time + 1;
+			Packets[PacketCount++] = (Sim_PendingPacket_t){ at, eye };
+		}
+	}
+
+	/* Noise picked up by the sync cable: pulses against the current level at random times */
+	if (GlitchEnd && Sim_Now >= GlitchEnd)
+	{
+		Input_Set(SIM_SYNC_BIT, SyncLevel);
+		GlitchEnd = 0;
+	}
+	else if (Sim_Config.Glitches && (Sim_Config.SyncMode & SYNCMODE_EXTERNAL) && Sim_Now >= GlitchAt)
+	{
+		if (GlitchAt)
+		{
+			Input_Set(SIM_SYNC_BIT, !SyncLevel);
+			GlitchEnd = Sim_Now + SIM_US(1 + Sim_Random() % 20);
+		}
+		GlitchAt = Sim_Now + 1 + Sim_Random() % (2 * SIM_US(1000000) / Sim_Config.Glitches);
+	}
+
+	if (PacketCount && Sim_Now >= Packets[0].Time)
+	{
+		/* Eye sync packet for the frame just shown: 0xFE = left, 0xFF = right */
+		uint8_t packet[8] = { 0xAA, (Packets[0].Eye == EYE_LEFT) ? 0xFE : 0xFF };
+		Sim_USB_QueueOUT(EMITTER_EP_SWAP_OUT, packet, sizeof(packet), -1);
+		memmove(&Packets[0], &Packets[1], --PacketCount * sizeof(Packets[0]));
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* Core                                                                       */
+/* ------------------------------------------------------------------------- */
+
+static void Cpu_RunHandler(void)
+{
+	Vectors[ActiveVector].Handler();
+}
+
+static void Cpu_Tick(void)
+{
+	if (ActiveVector >= 0)
+	{
+		if (Sim_Now < HandlerAt)
+			return;
+
+		SREG &= ~_BV(SREG_I);
+		Firmware_Run(Cpu_RunHandler);
+		SREG |= _BV(SREG_I); // RETI
+
+		CpuFreeAt    = Sim_Now + Vectors[ActiveVector].Ticks;
+		ActiveVector = -1;
+		Sleeping     = false;
+		return;
+	}
+
+	if (Sim_Now < CpuFreeAt || !(SREG & _BV(SREG_I)))
+		return;
+
+	for (uint8_t i = 0; i < SIM_VECTORS; i++)
+	{
+		const Sim_Vector_t* vector = &Vectors[i];
+		if (!(*vector->EnableReg & _BV(vector->EnableBit)) || !(*vector->FlagReg & _BV(vector->FlagBit)))
+			continue;
+
+		if (vector->ClearOnEntry)
+			*vector->FlagReg &= ~_BV(vector->FlagBit);
+		ActiveVector = i;
+		HandlerAt    = Sim_Now + Sim_Config.IsrLatency + Sleeping; // Idle wake-up adds 4 cycles
+		break;
+	}
+}
+
+static void Sim_Tick(void)
+{
+	Sim_Now++;
+
+	Stimulus_Tick();
+	Sim_Replay_Tick();
+	Sim_USB_Tick();
+	Timers_Tick();
+	Uart_Tick();
+	Cpu_Tick();
+	Signals_Sample();
+
+	if (Sim_Now >= SIM_US(Sim_Config.DurationMS * 1000ULL))
+		Sim_Finish();
+}
+
+static void Main_Start(void)
+{
+	Sim_USB_Start();
+	if (Sim_Config.Protocol)
+		Sim_SelectProtocol(Sim_ProtocolID(Sim_Config.Protocol));
+	Sim_SetSyncMode(Sim_Config.SyncMode);
+}
+
+static void Main_Enter(void)
+{
+	Regs_Collect();
+
+	if (!Started)
+	{
+		Started = true;
+		Firmware_Run(Main_Start);
+		Stimulus_Start();
+	}
+}
+
+/** Hands the CPU to the simulator for a stretch of main loop execution */
+void Sim_Yield(uint16_t ticks)
+{
+	Main_Enter();
+
+	while (ticks)
+	{
+		Sim_Tick();
+		if (Sim_Now >= CpuFreeAt && ActiveVector < 0)
+			ticks--;
+	}
+
+	Regs_Park();
+}
+
+/** sleep_cpu(): idles until an interrupt handler has run, then charges one main loop pass */
+void Sim_Sleep(void)
+{
+	if (!(SREG & _BV(SREG_I)))
+		Sim_Fatal("sleep with interrupts disabled, nothing can wake the CPU");
+
+	Main_Enter();
+	Sleeping = true;
+	while (Sleeping)
+	{
+		Sim_Tick();
+		SleepTicks++;
+	}
+	Regs_Park();
+
+	Sim_Yield(Sim_Config.LoopTicks);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Report                                                                     */
+/* ------------------------------------------------------------------------- */
+
+typedef struct
+{
+	uint32_t First;  /**< Index of the first (rising) edge in IrEdges */
+	uint32_t Edges;
+	int8_t   Token;  /**< Best matching protocol token, -1 if none fits */
+	uint32_t Error;  /**< Largest interval error against the matched token, in ticks */
+} Sim_Token_t;
+
+static int8_t Report_MatchToken(uint32_t first, uint32_t edges, uint32_t* error)
+{
+	int8_t   best = -1;
+	uint32_t bestError = UINT32_MAX;
+
+	for (uint8_t token = 0; token < 4; token++)
+	{
+		uint8_t size = Sim_TokenSize(token);
+		if (size == 0 || size + 1u != edges)
+			continue;
+
+		uint32_t worst = 0;
+		for (uint8_t i = 0; i < size; i++)
+		{
+			int64_t measured = IrEdges[first + i + 1].Time - IrEdges[first + i].Time;
+			int64_t diff     = llabs(measured - Sim_TokenTicks(token, i));
+			if (diff > worst)
+				worst = diff;
+		}
+		if (worst < bestError)
+		{
+			best      = token;
+			bestError = worst;
+		}
+	}
+
+	*error = bestError;
+	return best;
+}
+
+/* Token of any protocol sent starting at rising edge first, the closest fit among those
+   followed by the mix gap. Mixed protocols' tokens follow each other closer than the gap
+   split needs */
+static int8_t Report_MatchAt(uint32_t first, uint32_t* edges, uint32_t* error)
+{
+	int8_t best = -1;
+	*edges = 0;
+	*error = UINT32_MAX;
+
+	for (uint8_t token = 0; token < 4 * Sim_ProtocolCount(); token++)
+	{
+		uint8_t size = Sim_TokenSize(token);
+		if (size == 0 || first + size >= IrEdgeCount)
+			continue;
+		if (first + size + 1 < IrEdgeCount &&
+		    IrEdges[first + size + 1].Time - IrEdges[first + size].Time < SIM_US(IR_MIX_GAP - 10))
+			continue;
+
+		uint32_t worst = 0;
+		for (uint8_t i = 0; i < size; i++)
+		{
+			int64_t measured = IrEdges[first + i + 1].Time - IrEdges[first + i].Time;
+			int64_t diff     = llabs(measured - Sim_TokenTicks(token, i));
+			if (diff > worst)
+				worst = diff;
+		}
+		if (worst > SIM_US(10))
+			continue;
+		if (worst < *error || (worst == *error && size + 1u > *edges))
+		{
+			best   = token;
+			*edges = size + 1;
+			*error = worst;
+		}
+	}
+	return best;
+}
+
+/* Writes replayed packets and IR tokens in time order */
+static void Report_Timeline(const Sim_Token_t* tokens, uint32_t tokenCount)
+{
+	static const char* const TokenNames[] = { "open right", "close right", "open left", "close left" };
+	const double ms = SIM_US(1000);
+
+	FILE* file = fopen(Sim_Config.TimelinePath, "w");
+	if (!file)
+		Sim_Fatal("can't write %s", Sim_Config.TimelinePath);
+	fprintf(file, "# time_ms  event\n");
+
+	uint32_t p = 0, t = 0;
+	while (p < Sim_Replay_Count() || t < tokenCount)
+	{
+		const Sim_ReplayPacket_t* packet = (p < Sim_Replay_Count()) ? Sim_Replay_Packet(p) : NULL;
+		if (packet && packet->Time > Sim_Now)
+		{
+			p++;
+			continue;
+		}
+		if (t < tokenCount && (!packet || IrEdges[tokens[t].First].Time < packet->Time))
+		{
+			const Sim_Token_t* token = &tokens[t++];
+			fprintf(file, "%10.3f  IR  %-11s %3u edges", IrEdges[token->First].Time / ms,
+			        (token->Token < 0) ? "unknown" : TokenNames[token->Token & 3], token->Edges);
+			if (token->Token >= 4)
+				fprintf(file, ", %s", Sim_SentProtocol(token->Token / 4));
+			if (token->Token >= 0)
+				fprintf(file, ", error %.1f us", token->Error / (double)SIM_TICKS_PER_US);
+			fprintf(file, "\n");
+			continue;
+		}
+
+		p++;
+		bool in = packet->Address & ENDPOINT_DIR_IN;
+		fprintf(file, "%10.3f  %-3s %02X ", packet->Time / ms, in ? "IN" : "OUT", packet->Address);
+		for (uint8_t i = 0; i < packet->Length; i++)
+			fprintf(file, " %02x", packet->Data[i]);
+		if (!in && packet->Processed)
+			fprintf(file, "  bank +%.1f us, done +%.1f us", (packet->Delivered - packet->Time) / (double)SIM_TICKS_PER_US,
+			        (packet->Processed - packet->Delivered) / (double)SIM_TICKS_PER_US);
+		else if (!in)
+			fprintf(file, "  not processed");
+		fprintf(file, "\n");
+	}
+	fclose(file);
+}
+
+static void Sim_Finish(void)
+{
+	/* Split the IR edge stream into tokens at gaps longer than any in-token gap */
+	const uint64_t tokenGap = SIM_US(1000);
+	const uint64_t warmup   = SIM_US(Sim_Config.WarmupMS * 1000ULL);
+
+	Sim_Token_t* tokens = calloc(IrEdgeCount + 1, sizeof(*tokens));
+	uint32_t     tokenCount = 0;
+	bool         mixed = Sim_ProtocolCount() > 1;
+
+	for (uint32_t i = 0; i < IrEdgeCount; )
+	{
+		if (!IrEdges[i].Level)
+		{
+			i++;
+			continue;
+		}
+		uint32_t j = i + 1;
+		while (j < IrEdgeCount && (IrEdges[j].Time - IrEdges[j - 1].Time) < tokenGap)
+			j++;
+		int8_t   match = -1;
+		uint32_t edges, error;
+		if (mixed && (match = Report_MatchAt(i, &edges, &error)) >= 0)
+			j = i + edges;
+		if (IrEdges[j - 1].Level || (Sim_Now - IrEdges[j - 1].Time) < tokenGap)
+			break; // possibly still transmitting at the end of the run
+		if (IrEdges[i].Time < warmup)
+		{
+			i = j;
+			continue;
+		}
+
+		Sim_Token_t* token = &tokens[tokenCount++];
+		token->First = i;
+		token->Edges = j - i;
+		if (mixed)
+		{
+			token->Token = match;
+			token->Error = error;
+		}
+		else
+		{
+			token->Token = Report_MatchToken(i, j - i, &token->Error);
+		}
+		i = j;
+	}
+
+	uint32_t unmatched = 0, maxError = 0, maxDurationError = 0;
+	uint64_t errorSum = 0;
+	uint32_t errorCount = 0;
+	for (uint32_t i = 0; i < tokenCount; i++)
+	{
+		if (tokens[i].Token < 0)
+		{
+			unmatched++;
+			continue;
+		}
+		if (tokens[i].Error > maxError)
+			maxError = tokens[i].Error;
+		errorSum += tokens[i].Error;
+		errorCount++;
+
+		/* Opening token followed by its closing token: check the shutter open window. Only the
+		   active protocol's, mixed protocols' tokens may have been moved */
+		uint32_t k = i + 1;
+		while (k < tokenCount && tokens[k].Token >= 4)
+			k++;
+		if (k < tokenCount && tokens[i].Token < 4 && !(tokens[i].Token & 1) && tokens[k].Token == tokens[i].Token + 1)
+		{
+			uint64_t end   = IrEdges[tokens[i].First + tokens[i].Edges - 1].Time;
+			uint64_t start = IrEdges[tokens[k].First].Time;
+			uint32_t diff  = llabs((int64_t)(start - end) - Sim_FrameDuration());
+			if (diff > maxDurationError)
+				maxDurationError = diff;
+		}
+	}
+
+	/* Mixed protocols: tokens sent and how far their opening tokens follow the active one's,
+	   negative ahead of it. Each is paired with the nearest active opening token, a protocol
+	   with a larger lead opens before the active one of its frame */
+	uint32_t mixTokens[IR_MIX_MAX + 1] = { 0 }, mixOpens[IR_MIX_MAX + 1] = { 0 };
+	uint32_t mixError[IR_MIX_MAX + 1] = { 0 };
+	int64_t  mixDelay[IR_MIX_MAX + 1] = { 0 };
+	uint64_t activeOpen = 0, nextOpen = 0;
+	uint32_t next = 0;
+	const uint64_t pairing = SIM_US(500000.0 / Sim_Config.RefreshRate); // Half a frame
+	for (uint32_t i = 0; mixed && i < tokenCount; i++)
+	{
+		if (tokens[i].Token < 0)
+			continue;
+		uint8_t  index = tokens[i].Token / 4;
+		uint64_t start = IrEdges[tokens[i].First].Time;
+		mixTokens[index]++;
+		if (tokens[i].Error > mixError[index])
+			mixError[index] = tokens[i].Error;
+		if (tokens[i].Token & 1)
+			continue;
+		if (index == 0)
+		{
+			activeOpen = start;
+			continue;
+		}
+		for (next = (next > i) ? next : i + 1; next < tokenCount; next++)
+		{
+			if (tokens[next].Token >= 0 && tokens[next].Token < 4 && !(tokens[next].Token & 1))
+				break;
+		}
+		nextOpen = (next < tokenCount) ? IrEdges[tokens[next].First].Time : 0;
+		int64_t delay = activeOpen ? (int64_t)(start - activeOpen) : INT64_MAX;
+		if (nextOpen && (int64_t)(nextOpen - start) < llabs(delay))
+			delay = -(int64_t)(nextOpen - start);
+		if (llabs(delay) < (int64_t)pairing)
+		{
+			mixDelay[index] += delay;
+			mixOpens[index]++;
+		}
+	}
+
+	/* Match display frames to the opening token that followed them */
+	uint32_t emitted = 0, missed = 0, eyeErrors = 0;
+	int64_t  lead = SIM_US(Sim_ActiveLead());
+	uint64_t latencySum = 0, latencyMin = UINT64_MAX, latencyMax = 0;
+	uint32_t t = 0;
+	bool     synced = (Sim_Config.SyncMode != SYNCMODE_FREERUN) && (Sim_Config.SyncMode != SYNCMODE_NONE);
+	if (Sim_Replay_Active())
+		synced = false; // Captured packets don't follow the simulated display
+	for (uint32_t f = 0; synced && f < FrameCount; f++)
+	{
+		uint64_t from = Frames[f].Time - lead; // Frames are due the lead ahead of their edge
+		if (from < warmup)
+			continue;
+		uint64_t to   = (f + 1 < FrameCount) ? Frames[f + 1].Time - lead : Sim_Now;
+		while (t < tokenCount && IrEdges[tokens[t].First].Time < from)
+			t++;
+		uint32_t k = t;
+		while (k < tokenCount && (tokens[k].Token < 0 || tokens[k].Token >= 4 || (tokens[k].Token & 1)) && IrEdges[tokens[k].First].Time < to)
+			k++;
+		if (k >= tokenCount || IrEdges[tokens[k].First].Time >= to)
+		{
+			/* Protocols without a token for this eye (Samsung07) don't miss anything */
+			if (f + 1 < FrameCount && Sim_TokenSize(Frames[f].Eye == EYE_LEFT ? 2 : 0))
+				missed++;
+			continue;
+		}
+
+		uint64_t latency = IrEdges[tokens[k].First].Time - from;
+		latencySum += latency;
+		if (latency < latencyMin)
+			latencyMin = latency;
+		if (latency > latencyMax)
+			latencyMax = latency;
+		emitted++;
+
+		uint8_t eye = (tokens[k].Token == 0) ? EYE_RIGHT : EYE_LEFT;
+		if (eye != Frames[f].Eye)
+			eyeErrors++;
+	}
+
+	/* Opening token to opening token spacing */
+	uint64_t lastOpen = 0;
+	double   intervalSum = 0, intervalSq = 0;
+	uint64_t intervalMin = UINT64_MAX, intervalMax = 0;
+	uint32_t intervals = 0;
+	for (uint32_t i = 0; i < tokenCount; i++)
+	{
+		if (tokens[i].Token < 0 || tokens[i].Token >= 4 || (tokens[i].Token & 1))
+			continue;
+		uint64_t start = IrEdges[tokens[i].First].Time;
+		if (lastOpen)
+		{
+			uint64_t interval = start - lastOpen;
+			intervalSum += interval;
+			intervalSq  += (double)interval * interval;
+			if (interval < intervalMin)
+				intervalMin = interval;
+			if (interval > intervalMax)
+				intervalMax = interval;
+			intervals++;
+		}
+		lastOpen = start;
+	}
+
+	/* Replayed packets: host send to endpoint bank, bank to release by the firmware */
+	bool     replay = Sim_Replay_Active();
+	Sim_Replay_Finish();
+	uint32_t replayOut = 0, replayIn = 0, replayLost = 0;
+	uint64_t busSum = 0, busMax = 0, fwSum = 0, fwMin = UINT64_MAX, fwMax = 0;
+	uint32_t replaySwap = 0;
+	uint64_t swapSum = 0, swapMax = 0; // Swap packets alone, they are what the frame timing waits for
+	for (uint32_t i = 0; i < Sim_Replay_Count(); i++)
+	{
+		const Sim_ReplayPacket_t* packet = Sim_Replay_Packet(i);
+		if (packet->Address & ENDPOINT_DIR_IN)
+		{
+			replayIn++;
+			continue;
+		}
+		if (packet->Time > Sim_Now)
+			continue; // Beyond the end of the run
+		if (!packet->Processed)
+		{
+			replayLost++;
+			continue;
+		}
+		uint64_t bus = packet->Delivered - packet->Time;
+		uint64_t fw  = packet->Processed - packet->Delivered;
+		busSum += bus;
+		fwSum  += fw;
+		if (bus > busMax)
+			busMax = bus;
+		if (fw < fwMin)
+			fwMin = fw;
+		if (fw > fwMax)
+			fwMax = fw;
+		replayOut++;
+		if (packet->Address == EMITTER_EP_SWAP_OUT)
+		{
+			swapSum += fw;
+			if (fw > swapMax)
+				swapMax = fw;
+			replaySwap++;
+		}
+	}
+	if (Sim_Config.TimelinePath)
+		Report_Timeline(tokens, tokenCount);
+
+	static const char* const ModeNames[] = { "none", "driver", "external", "combined", "freerun" };
+	const double us = SIM_TICKS_PER_US;
+	const char* protocol = Sim_ActiveProtocol();
+	if (!protocol)
+		protocol = Sim_Config.Upload ? Sim_Config.Upload : "eeprom";
+	char protocols[64];
+	snprintf(protocols, sizeof(protocols), "%s", protocol);
+	for (uint8_t i = 1; i < Sim_ProtocolCount(); i++)
+		snprintf(protocols + strlen(protocols), sizeof(protocols) - strlen(protocols), "+%s", Sim_SentProtocol(i));
+
+	if (Sim_Config.Quiet)
+	{
+		printf("%-10s %-8s %7.3fHz  frames %5u  missed %4u  eye %4u  latency %7.1f/%7.1f us  jitter %7.1f us  edge %4.1f us\n",
+		       protocols, ModeNames[Sim_Config.SyncMode], Sim_Config.RefreshRate,
+		       synced ? emitted : intervals + !!lastOpen, missed, eyeErrors,
+		       emitted ? latencyMin / us : 0.0, emitted ? latencyMax / us : 0.0,
+		       intervals ? (intervalMax - intervalMin) / us : 0.0, maxError / us);
+	}
+	else
+	{
+		printf("protocol     %s%s\n", protocol, Sim_ActiveProtocol() ? "" : " (uploaded)");
+		printf("sync mode    %s\n", ModeNames[Sim_Config.SyncMode]);
+		printf("refresh      %.3f Hz over %u ms\n", Sim_Config.RefreshRate, Sim_Config.DurationMS);
+		if (Sim_Config.WarmupMS)
+			printf("warmup       first %u ms not counted\n", Sim_Config.WarmupMS);
+		printf("tokens       %u (%u unmatched)\n", tokenCount, unmatched);
+		for (uint8_t i = 1; i < Sim_ProtocolCount(); i++)
+		{
+			printf("mixed        %s: %u tokens, edge error max %.1f us", Sim_SentProtocol(i), mixTokens[i], mixError[i] / us);
+			if (mixOpens[i])
+			{
+				double delay = mixDelay[i] / us / mixOpens[i];
+				printf(", opens %.1f us %s %s", fabs(delay), (delay < 0) ? "before" : "after", protocol);
+			}
+			printf("\n");
+		}
+		if (synced)
+		{
+			printf("frames       %u emitted, %u missed, %u wrong eye\n", emitted, missed, eyeErrors);
+			if (emitted)
+				printf("latency      min %.1f  avg %.1f  max %.1f us (sync edge%s to first IR pulse)\n",
+				       latencyMin / us, latencySum / us / emitted, latencyMax / us, lead ? " less the lead" : "");
+		}
+		if (intervals)
+		{
+			double mean = intervalSum / intervals;
+			printf("interval     min %.1f  avg %.1f  max %.1f  stddev %.2f us\n",
+			       intervalMin / us, mean / us, intervalMax / us, sqrt(fmax(0, intervalSq / intervals - mean * mean)) / us);
+		}
+		printf("edge error   max %.1f  avg %.2f us (pulse/gap length vs protocol table)\n",
+		       maxError / us, errorCount ? errorSum / us / errorCount : 0.0);
+		printf("window       %.1f us, error max %.1f us (shutter open time vs current window)\n",
+		       Sim_FrameDuration() / us, maxDurationError / us);
+		printf("usb drift    %d ppm measured, %.1f ppm simulated (crystal vs host SOF clock)\n", sofDrift, Sim_Config.UsbClockPPM);
+		printf("cpu          %.1f%% asleep\n", 100.0 * SleepTicks / Sim_Now);
+		if (Sim_USB_Latency.Packets)
+			printf("usb out      %u packets, bank to release avg %.1f  max %.1f us (event to handler)\n",
+			       Sim_USB_Latency.Packets, Sim_USB_Latency.Sum / us / Sim_USB_Latency.Packets, Sim_USB_Latency.Max / us);
+		if (EepromWrites)
+			printf("eeprom       %u bytes written\n", EepromWrites);
+		if (replay)
+		{
+			printf("replay       %u packets processed, %u pending at the end, %u IN packets sent back\n", replayOut, replayLost, replayIn);
+			if (replayOut)
+				printf("             bus wait avg %.1f  max %.1f us, firmware min %.1f  avg %.1f  max %.1f us\n",
+				       busSum / us / replayOut, busMax / us, fwMin / us, fwSum / us / replayOut, fwMax / us);
+			if (replaySwap)
+				printf("             swap packets firmware avg %.1f  max %.1f us\n", swapSum / us / replaySwap, swapMax / us);
+		}
+		if (StatsSnapshots)
+		{
+			printf("stats        %u snapshots, last: frames %u right %u left, %u missed, %u late, %u timeouts, %u eye fixes, %u glitches, %u eye slips\n",
+			       StatsSnapshots, Stats_Read(0, 0, 4), Stats_Read(0, 4, 4), Stats_Read(0, 8, 2), Stats_Read(0, 10, 2),
+			       Stats_Read(0, 12, 2), Stats_Read(0, 14, 2), Stats_Read(0, 23, 2), Stats_Read(0, 25, 2));
+			printf("             period %.1f us, window %.1f us, %u UART bytes dropped\n",
+			       Stats_Read(0, 16, 2) / us, Stats_Read(0, 18, 2) / us, Stats_Read(0, 20, 2));
+			for (uint8_t page = 1; page < STATS_PAGES; page++)
+			{
+				printf("             %-9s", (page == 1) ? "interval" : "latency");
+				for (uint8_t bin = 0; bin < IR_STATS_BINS; bin++)
+					printf(" %5u", Stats_Read(page, bin * 2, 2));
+				printf("  (below %u, %u, %u ... us)\n", (page == 1) ? 1 : 8, (page == 1) ? 2 : 16, (page == 1) ? 4 : 32);
+			}
+		}
+		if (Sim_Config.Profile && !(ProfileReceived & 1))
+			printf("profile      no reply\n");
+		else if (Sim_Config.Profile && !ProfileReplies[0][2])
+			printf("profile      not built in, needs CDEFS=-DEMITTER_PROFILE\n");
+		else if (Sim_Config.Profile)
+		{
+			/* Handlers run in no simulated time, the cycle counts are all 0: calls, entry latency and the loop rate */
+			double seconds = Profile_Value(PROFILE_VECTORS, 4, 4) / (SIM_TICKS_PER_US * 1e6);
+			printf("profile      %-12s %8s %8s  latency max us\n", "vector", "calls", "per s");
+			for (uint8_t i = 0; i < PROFILE_VECTORS; i++)
+			{
+				uint32_t calls = Profile_Value(i, 0, 4);
+				if (calls)
+					printf("             %-12s %8u %8.0f  %.1f\n", ProfileNames[i], calls, seconds ? calls / seconds : 0.0, Profile_Value(i, 14, 2) / us);
+			}
+			printf("             main loop %u iterations, %.0f/s over %.1f ms\n", Profile_Value(PROFILE_VECTORS, 0, 4),
+			       seconds ? Profile_Value(PROFILE_VECTORS, 0, 4) / seconds : 0.0, seconds * 1000);
+		}
+	}
+
+	if (VcdFile)
+	{
+		fprintf(VcdFile, "#%llu\n", (unsigned long long)(Sim_Now * 5));
+		fclose(VcdFile);
+	}
+	if (UartFile)
+		fclose(UartFile);
+	if (Sim_Config.EepromPath)
+		Eeprom_Save(Sim_Config.EepromPath);
+
+	free(tokens);
+	exit(unmatched ? 1 : 0);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Entry point                                                                */
+/* ------------------------------------------------------------------------- */
+
+static void Usage(void)
+{
+	fprintf(stderr,
+		"usage: emitter-sim [options]\n"
+		"  -p, --protocol NAME    IR protocol (default as stored in EEPROM, else 3dvision):");
+	for (uint8_t i = 0; Sim_ProtocolName(i); i++)
+		fprintf(stderr, " %s", Sim_ProtocolName(i));
+	fprintf(stderr, "\n"
+		"  -m, --mode MODE        driver, external, combined or freerun (default combined)\n"
+		"  -r, --rate HZ          display refresh rate (default 120)\n"
+		"  -t, --time MS          simulated time (default 1000)\n"
+		"  -w, --warmup MS        leave the first MS out of the statistics (default 0)\n"
+		"  -d, --usb-delay US     frame edge to swap packet delay (default 300)\n"
+		"  -j, --usb-jitter US    random spread added to the delay (default 500)\n"
+		"  -c, --usb-ppm PPM      host USB clock offset against the AVR crystal (default 0)\n"
+		"  -l, --loop-ticks N     main loop iteration cost in 0.5us ticks (default 10)\n"
+		"  -i, --isr-latency N    interrupt entry latency in 0.5us ticks (default 2)\n"
+		"  -f, --force-pin LEVEL  POLSEL pin level, 0 takes eye polarity from VESA in combined mode\n"
+		"  -g, --glitches N       noise pulses per second on the VESA sync input\n"
+		"  -D, --dropout MS       sync edges and swap packets stop for MS once a second\n"
+		"  -k, --usb-slip MS      swap packets come a frame late for MS once a second\n"
+		"  -F, --flywheel N       predicted frames across a dropout (CMD_FLYWHEEL, default 12)\n"
+		"  -L, --lead US          send opening tokens US ahead of the frame edge, negative after (CMD_PROTOCOL_LEAD,\n"
+		"                         default the protocol's own), latency is measured from the edge less the lead\n"
+		"  -s, --seed N           jitter random seed\n"
+		"  -o, --vcd FILE         write pin timeline\n"
+		"  -u, --uart FILE        write raw USART1 output\n"
+		"  -U, --upload NAME      upload protocol NAME over USB at start, -p is the built-in one\n"
+		"  -M, --mix NAMES        also send the comma separated built-in protocols (CMD_PROTOCOL_MIX)\n"
+		"  -e, --eeprom FILE      keep EEPROM contents in FILE between runs\n"
+		"  -S, --stats MS         have the emitter publish statistics every MS (10ms steps, run on 32.8ms ticks)\n"
+		"  -R, --replay FILE      play captured host packets instead of generated swap packets\n"
+		"  -T, --timeline FILE    write replayed packets and IR tokens in time order\n"
+		"  -P, --profile          read the ISR profile before the end, needs CDEFS=-DEMITTER_PROFILE\n"
+		"  -q, --quiet            one line summary\n");
+	exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+	static const struct option options[] = {
+		{ "protocol",    required_argument, NULL, 'p' },
+		{ "mode",        required_argument, NULL, 'm' },
+		{ "rate",        required_argument, NULL, 'r' },
+		{ "time",        required_argument, NULL, 't' },
+		{ "warmup",      required_argument, NULL, 'w' },
+		{ "usb-delay",   required_argument, NULL, 'd' },
+		{ "usb-jitter",  required_argument, NULL, 'j' },
+		{ "usb-ppm",     required_argument, NULL, 'c' },
+		{ "loop-ticks",  required_argument, NULL, 'l' },
+		{ "isr-latency", required_argument, NULL, 'i' },
+		{ "force-pin",   required_argument, NULL, 'f' },
+		{ "glitches",    required_argument, NULL, 'g' },
+		{ "dropout",     required_argument, NULL, 'D' },
+		{ "usb-slip",    required_argument, NULL, 'k' },
+		{ "flywheel",    required_argument, NULL, 'F' },
+		{ "lead",        required_argument, NULL, 'L' },
+		{ "seed",        required_argument, NULL, 's' },
+		{ "vcd",         required_argument, NULL, 'o' },
+		{ "uart",        required_argument, NULL, 'u' },
+		{ "upload",      required_argument, NULL, 'U' },
+		{ "mix",         required_argument, NULL, 'M' },
+		{ "eeprom",      required_argument, NULL, 'e' },
+		{ "stats",       required_argument, NULL, 'S' },
+		{ "replay",      required_argument, NULL, 'R' },
+		{ "timeline",    required_argument, NULL, 'T' },
+		{ "profile",     no_argument,       NULL, 'P' },
+		{ "quiet",       no_argument,       NULL, 'q' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	bool durationSet = false;
+	int  opt;
+	while ((opt = getopt_long(argc, argv, "p:m:r:t:w:d:j:c:l:i:f:g:D:k:F:L:s:o:u:U:M:e:S:R:T:Pq", options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': Sim_Config.Protocol    = optarg; break;
+			case 'r': Sim_Config.RefreshRate = atof(optarg); break;
+			case 't': Sim_Config.DurationMS  = strtoul(optarg, NULL, 0); durationSet = true; break;
+			case 'w': Sim_Config.WarmupMS    = strtoul(optarg, NULL, 0); break;
+			case 'd': Sim_Config.UsbDelayUS  = strtoul(optarg, NULL, 0); break;
+			case 'j': Sim_Config.UsbJitterUS = strtoul(optarg, NULL, 0); break;
+			case 'c': Sim_Config.UsbClockPPM = atof(optarg); break;
+			case 'l': Sim_Config.LoopTicks   = strtoul(optarg, NULL, 0); break;
+			case 'i': Sim_Config.IsrLatency  = strtoul(optarg, NULL, 0); break;
+			case 'f': Sim_Config.ForcePin    = atoi(optarg) != 0; break;
+			case 'g': Sim_Config.Glitches    = strtoul(optarg, NULL, 0); break;
+			case 'D': Sim_Config.DropoutMS   = strtoul(optarg, NULL, 0); break;
+			case 'k': Sim_Config.SlipMS      = strtoul(optarg, NULL, 0); break;
+			case 'F': Sim_Config.Flywheel    = strtol(optarg, NULL, 0); break;
+			case 'L': Sim_Config.LeadUS      = strtol(optarg, NULL, 0); break;
+			case 's': Sim_Config.Seed        = strtoul(optarg, NULL, 0); break;
+			case 'o': Sim_Config.VcdPath     = optarg; break;
+			case 'u': Sim_Config.UartPath    = optarg; break;
+			case 'U': Sim_Config.Upload      = optarg; break;
+			case 'M': Sim_Config.Mix         = optarg; break;
+			case 'e': Sim_Config.EepromPath  = optarg; break;
+			case 'R': Sim_Config.ReplayPath  = optarg; break;
+			case 'T': Sim_Config.TimelinePath = optarg; break;
+			case 'S': Sim_Config.StatsRate   = (strtoul(optarg, NULL, 0) + 9) / 10; break;
+			case 'P': Sim_Config.Profile     = true; break;
+			case 'q': Sim_Config.Quiet       = true; break;
+			case 'm':
+				if      (!strcmp(optarg, "driver"))   Sim_Config.SyncMode = SYNCMODE_DRIVER;
+				else if (!strcmp(optarg, "external")) Sim_Config.SyncMode = SYNCMODE_EXTERNAL;
+				else if (!strcmp(optarg, "combined")) Sim_Config.SyncMode = SYNCMODE_COMBINED;
+				else if (!strcmp(optarg, "freerun"))  Sim_Config.SyncMode = SYNCMODE_FREERUN;
+				else Usage();
+				break;
+			default:
+				Usage();
+		}
+	}
+	if (optind < argc || Sim_Config.RefreshRate <= 0 || Sim_Config.LoopTicks == 0)
+		Usage();
+
+	if (Sim_Config.Protocol && Sim_ProtocolID(Sim_Config.Protocol) < 0)
+	{
+		fprintf(stderr, "sim: unknown protocol '%s'\n", Sim_Config.Protocol);
+		Usage();
+	}
+	if (Sim_Config.Upload && !Sim_ProtocolImage(Sim_Config.Upload, (uint8_t[IR_IMAGE_MAX]){ 0 }))
+	{
+		fprintf(stderr, "sim: unknown protocol '%s'\n", Sim_Config.Upload);
+		Usage();
+	}
+	if (Sim_Config.Mix && Mix_Parse(Sim_Config.Mix, (uint8_t[IR_MIX_MAX + 1]){ 0 }, IR_MIX_MAX) < 0)
+	{
+		fprintf(stderr, "sim: unknown protocol or more than %d in '%s'%s\n", IR_MIX_MAX, Sim_Config.Mix,
+		        IR_MIX_MAX ? "" : ", mixing needs CDEFS=-DIR_MIX");
+		Usage();
+	}
+	Eeprom_Load(Sim_Config.EepromPath);
+	if (Sim_Config.ReplayPath)
+	{
+		uint32_t length = Sim_Replay_Load(Sim_Config.ReplayPath);
+		if (!durationSet)
+			Sim_Config.DurationMS = length + 50; // Room for the last frames
+	}
+
+	if (Sim_Config.VcdPath)
+		Vcd_Open(Sim_Config.VcdPath);
+	if (Sim_Config.UartPath && !(UartFile = fopen(Sim_Config.UartPath, "wb")))
+		Sim_Fatal("can't open %s", Sim_Config.UartPath);
+
+	UartFlags = _BV(UDRE1);
+	if (Sim_Config.ForcePin)
+		ExtPIND |= _BV(POLSEL);
+	else
+		ExtPIND &= ~_BV(POLSEL);
+	ExtPIND &= ~_BV(SIM_SYNC_BIT);
+	Signals[SIGNAL_SYNC].Level = false;
+	Regs_Park();
+
+	Emitter_Main();
+	return 0;
+}
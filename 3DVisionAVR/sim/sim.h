@@ -0,0 +1,129 @@
+/** \file
+ *
+ *  Internal interface between the simulator modules (sim.c, usb.c, sim_ir.c).
+ */
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+/* Includes: */
+	#include <stdint.h>
+	#include <stdbool.h>
+	#include <stdio.h>
+
+/* Macros: */
+	/** Simulation time base: one tick is one Timer1 count at clk/8, i.e. 0.5us or 8 CPU cycles */
+	#define SIM_TICKS_PER_US     2
+	#define SIM_CYCLES_PER_TICK  8
+	#define SIM_US(us)           ((uint64_t)((us) * SIM_TICKS_PER_US))
+
+	#define SIM_MAX_PACKET       64
+	#define SIM_USB_FRAME        SIM_US(1000)  /**< Nominal USB full speed frame */
+	#define SIM_USB_BULK_OFFSET  SIM_US(10)    /**< SOF to bulk transaction start in an idle frame */
+	#define SIM_LEAD_KEEP        INT16_MIN     /**< LeadUS: no CMD_PROTOCOL_LEAD sent */
+
+/* Type Defines: */
+	typedef struct
+	{
+		const char* Protocol;    /**< Name of the IR protocol to select, NULL to keep the stored one */
+		uint8_t     SyncMode;    /**< SyncMode_t to run the emitter in */
+		double      RefreshRate; /**< Simulated display refresh rate in Hz */
+		uint32_t    DurationMS;  /**< Simulated time span */
+		uint32_t    WarmupMS;    /**< Leading time span left out of the statistics */
+		uint32_t    UsbDelayUS;  /**< Nominal display edge to swap packet arrival delay */
+		uint32_t    UsbJitterUS; /**< Peak-to-peak random spread added to UsbDelayUS */
+		double      UsbClockPPM; /**< Host (SOF) clock offset against the AVR crystal */
+		uint16_t    LoopTicks;   /**< Cost of one main loop iteration */
+		uint8_t     IsrLatency;  /**< Interrupt response + prologue, in ticks */
+		bool        ForcePin;    /**< Level of the combined-mode polarity select input (POLSEL) */
+		uint32_t    Glitches;    /**< Noise pulses per second on the VESA sync input */
+		uint32_t    DropoutMS;   /**< Sync edges and swap packets stop this long once a second */
+		uint32_t    SlipMS;      /**< Swap packets come a frame later than UsbDelayUS this long once a second */
+		int16_t     Flywheel;    /**< CMD_FLYWHEEL frames sent at start, -1 to keep the default */
+		int16_t     LeadUS;      /**< CMD_PROTOCOL_LEAD sent at start, SIM_LEAD_KEEP for the protocol's own */
+		uint32_t    Seed;        /**< Seed for the pseudo random USB jitter */
+		const char* VcdPath;     /**< Pin timeline output, NULL to disable */
+		const char* UartPath;    /**< Raw USART1 output, NULL to disable */
+		const char* Upload;      /**< Protocol to upload over EMITTER_EP_CONTROL_OUT at start, NULL for none */
+		const char* Mix;         /**< Comma separated protocols to send alongside with CMD_PROTOCOL_MIX, NULL for none */
+		const char* EepromPath;  /**< EEPROM contents kept between runs, NULL to start erased */
+		uint8_t     StatsRate;   /**< CMD_STATS_RATE interval in 10ms units sent at start, 0 for none */
+		const char* ReplayPath;  /**< Captured host traffic to play instead of the generated swap packets */
+		const char* TimelinePath;/**< Packet and IR token timeline output, NULL to disable */
+		bool        Profile;     /**< Read the ISR profile (CMD_PROFILE) shortly before the end */
+		bool        Quiet;       /**< Only print the summary line */
+	} Sim_Config_t;
+
+	typedef struct
+	{
+		uint64_t Time;      /**< Host sends the packet (OUT) or the firmware commits it (IN) */
+		uint64_t Delivered; /**< OUT: landed in the endpoint bank, 0 if it never did */
+		uint64_t Processed; /**< OUT: released by the firmware, 0 if it never was */
+		uint8_t  Address;
+		uint8_t  Length;
+		uint8_t  Data[SIM_MAX_PACKET];
+	} Sim_ReplayPacket_t;
+
+	typedef struct
+	{
+		uint32_t Packets;   /**< OUT packets released by the firmware */
+		uint64_t Sum;       /**< Bank to release time, in ticks */
+		uint64_t Max;
+	} Sim_USB_Latency_t;
+
+/* External Variables: */
+	extern Sim_Config_t      Sim_Config;
+	extern uint64_t          Sim_Now;
+	extern volatile uint16_t Sim_USB_Flags; /**< USB_GEN interrupt sources, UDINT layout */
+	extern volatile uint8_t  Sim_USB_ComEnable;
+	extern volatile uint16_t Sim_USB_ComFlags; /**< Bit 0: an endpoint interrupt is pending */
+	extern Sim_USB_Latency_t Sim_USB_Latency;
+
+/* Function Prototypes: */
+	/* sim.c */
+	void Sim_Yield(uint16_t ticks);
+	void Sim_Sleep(void);
+	void Sim_Fatal(const char* format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+	void Sim_Marker(uint8_t marker);
+	void Sim_ReceiveIN(uint8_t address, const uint8_t* data, uint8_t length);
+
+	/* usb.c */
+	void Sim_USB_Start(void);
+	void Sim_USB_Tick(void);
+	void Sim_USB_QueueOUT(uint8_t address, const uint8_t* data, uint8_t length, int32_t tag);
+
+	/* replay.c */
+	uint32_t                  Sim_Replay_Load(const char* path);
+	bool                      Sim_Replay_Active(void);
+	void                      Sim_Replay_Start(void);
+	void                      Sim_Replay_Tick(void);
+	void                      Sim_Replay_Delivered(int32_t tag);
+	void                      Sim_Replay_Processed(int32_t tag);
+	void                      Sim_Replay_ReceiveIN(uint8_t address, const uint8_t* data, uint8_t length);
+	void                      Sim_Replay_Finish(void);
+	uint32_t                  Sim_Replay_Count(void);
+	const Sim_ReplayPacket_t* Sim_Replay_Packet(uint32_t index);
+
+	/* sim_ir.c */
+	int         Sim_ProtocolID(const char* name);
+	void        Sim_SelectProtocol(uint8_t id);
+	const char* Sim_ProtocolName(uint8_t index);
+	const char* Sim_ActiveProtocol(void);
+	void        Sim_SetSyncMode(uint8_t mode);
+	uint8_t     Sim_ProtocolCount(void);
+	const char* Sim_SentProtocol(uint8_t index);
+	uint8_t     Sim_TokenSize(uint8_t token);
+	uint16_t    Sim_TokenTicks(uint8_t token, uint8_t index);
+	uint16_t    Sim_FrameDuration(void);
+	int16_t     Sim_ActiveLead(void);
+	uint8_t     Sim_ProtocolImage(const char* name, uint8_t* image);
+
+/* Markers shown in the VCD file */
+	enum Sim_Markers_t
+	{
+		SIM_MARKER_SwapPacket = 0, /**< Swap packet landed in the endpoint bank */
+		SIM_MARKER_SOF,            /**< USB start of frame */
+		SIM_MARKER_Count
+	};
+
+#endif /* _SIM_H_ */
@@ -0,0 +1,157 @@
+/** \file
+ *
+ *  Builds the IR emitter core for the simulator. The firmware source is included verbatim
+ *  so that the simulator can reach the active protocol and emitter state without the
+ *  firmware having to export anything it doesn't need on the target.
+ */
+
+#include "../IREmitter.c"
+
+#include <strings.h>
+#include "sim.h"
+
+static const struct
+{
+	const char* Name;
+	uint8_t     ID;
+} Protocols[] = {
+	{ "3dvision",  IR_PROTOCOL_3DVISION  },
+	{ "samsung07", IR_PROTOCOL_SAMSUNG07 },
+	{ "xpand",     IR_PROTOCOL_XPAND     },
+	{ "sharp",     IR_PROTOCOL_SHARP     },
+	{ "sony",      IR_PROTOCOL_SONY      },
+	{ "panasonic", IR_PROTOCOL_PANASONIC },
+};
+
+/** Built-in protocol ID by name, -1 if there is none */
+int Sim_ProtocolID(const char* name)
+{
+	for (uint8_t i = 0; i < sizeof(Protocols) / sizeof(Protocols[0]); i++)
+	{
+		if (strcasecmp(name, Protocols[i].Name) == 0)
+			return Protocols[i].ID;
+	}
+	return -1;
+}
+
+/** Switches protocols like CMD_PROTOCOL_SELECT, without storing the choice */
+void Sim_SelectProtocol(uint8_t id)
+{
+	SelectProtocol(id);
+	UpdateWindow();
+}
+
+const char* Sim_ProtocolName(uint8_t index)
+{
+	if (index >= sizeof(Protocols) / sizeof(Protocols[0]))
+		return NULL;
+	return Protocols[index].Name;
+}
+
+/** Name of the protocol the firmware runs, NULL for an uploaded one */
+const char* Sim_ActiveProtocol(void)
+{
+	for (uint8_t i = 0; i < sizeof(Protocols) / sizeof(Protocols[0]); i++)
+	{
+		if (Protocols[i].ID == protoID)
+			return Protocols[i].Name;
+	}
+	return NULL;
+}
+
+void Sim_SetSyncMode(uint8_t mode)
+{
+	IR_SetSyncMode((SyncMode_t)mode);
+}
+
+/** Protocols sent, the active one and then the mixed ones */
+uint8_t Sim_ProtocolCount(void)
+{
+	return mixCount + 1;
+}
+
+/** Name of protocol index as in Sim_ProtocolCount(), NULL for an uploaded one */
+const char* Sim_SentProtocol(uint8_t index)
+{
+	if (index == 0)
+		return Sim_ActiveProtocol();
+#ifdef IR_MIX
+	for (uint8_t i = 0; i < sizeof(Protocols) / sizeof(Protocols[0]); i++)
+	{
+		if (Protocols[i].ID == mixIDs[index - 1])
+			return Protocols[i].Name;
+	}
+#endif
+	return NULL;
+}
+
+/* Protocol of token index protocol * 4 + token */
+static const IR_Protocol_t* TokenProtocol(uint8_t token)
+{
+#ifdef IR_MIX
+	static IR_Protocol_t mixed = { .timings = { [IR_MAX_TIMINGS - 1] = 0 } };
+	static int loaded = -1;
+	uint8_t index = token / 4;
+	if (index != 0)
+	{
+		if (loaded != mixIDs[index - 1])
+		{
+			IR_ReadProtocol(mixIDs[index - 1], &mixed, IR_MAX_TIMINGS);
+			loaded = mixIDs[index - 1];
+		}
+		return &mixed;
+	}
+#endif
+	return &protoCache;
+}
+
+uint8_t Sim_TokenSize(uint8_t token)
+{
+	return TokenProtocol(token)->sizes[token & 3];
+}
+
+uint16_t Sim_TokenTicks(uint8_t token, uint8_t index)
+{
+	const IR_Protocol_t* protocol = TokenProtocol(token);
+	return protocol->timings[protocol->indices[token & 3] + index] * 2;
+}
+
+/** Lead of the active protocol in us, the host's or the built-in default */
+int16_t Sim_ActiveLead(void)
+{
+	return protoCache.lead;
+}
+
+uint16_t Sim_FrameDuration(void)
+{
+	return frameWindow; // Window in effect at the end of the run
+}
+
+/** Serialises a built-in protocol the way the host uploads it, returns the image length or 0 */
+uint8_t Sim_ProtocolImage(const char* name, uint8_t* image)
+{
+	static IR_Protocol_t protocol = { .timings = { [IR_MAX_TIMINGS - 1] = 0 } };
+	int id = Sim_ProtocolID(name);
+	if ((id < 0) || !IR_ReadProtocol(id, &protocol, IR_MAX_TIMINGS))
+		return 0;
+
+	uint8_t count = 0;
+	for (uint8_t token = 0; token < 4; token++)
+	{
+		image[token]     = protocol.sizes[token];
+		image[4 + token] = protocol.indices[token];
+		if (protocol.sizes[token] && (protocol.indices[token] + protocol.sizes[token]) > count)
+			count = protocol.indices[token] + protocol.sizes[token];
+	}
+	image[8]  = protocol.duty;
+	image[9]  = protocol.guard & 0xFF;
+	image[10] = protocol.guard >> 8;
+	image[11] = protocol.lead & 0xFF;
+	image[12] = (uint16_t)protocol.lead >> 8;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		image[IR_IMAGE_HEADER + 2 * i]     = protocol.timings[i] & 0xFF;
+		image[IR_IMAGE_HEADER + 2 * i + 1] = protocol.timings[i] >> 8;
+	}
+	return IR_IMAGE_HEADER + 2 * count;
+}
@@ -0,0 +1,383 @@
+/** \file
+ *
+ *  Host test of the timer wheel in Timers.c, built against the same register stand-ins as the
+ *  simulator. Checks expiry to the tick across wheel turns, restart, stop, the clamp on long
+ *  timeouts and handlers starting and stopping events from inside Timer_Tick(), then times
+ *  Timer_Start() and Timer_Tick() with growing numbers of timers running:
+ *
+ *      build/timers_test        tests and benchmark, exits 1 on a failed check
+ *      build/timers_test -q     tests only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../Emitter.h"
+#include "../Timers.h"
+
+volatile uint8_t SREG; // Timers.c saves and restores the interrupt flag, sim.c isn't linked
+
+static uint32_t now; // Ticks run so far
+static uint32_t failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __func__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+/* Handlers log when they ran, the tests tell them apart by handler */
+static uint32_t firedA, firedB, firedC;
+static uint32_t atA, atB, atC;
+static void FireA(void) { firedA++; atA = now; }
+static void FireB(void) { firedB++; atB = now; }
+static void FireC(void) { firedC++; atC = now; }
+
+static Timer_Event_t eventA = { .handler = FireA };
+static Timer_Event_t eventB = { .handler = FireB };
+static Timer_Event_t eventC = { .handler = FireC };
+
+static void Tick(uint32_t ticks)
+{
+	while (ticks--)
+	{
+		now++;
+		Timer_Tick();
+	}
+}
+
+static void Reset(void)
+{
+	Timer_Stop(&eventA);
+	Timer_Stop(&eventB);
+	Timer_Stop(&eventC);
+	firedA = firedB = firedC = 0;
+	atA = atB = atC = 0;
+}
+
+/* Fires after exactly ticks, from every phase of the wheel */
+static void TestExpiry(void)
+{
+	static const uint16_t timeouts[] = { 1, 2, TIMER_SLOTS - 1, TIMER_SLOTS, TIMER_SLOTS + 1, 2 * TIMER_SLOTS,
+	                                     200, 1000, TIMER_MAX_TICKS - 1, TIMER_MAX_TICKS };
+	for (uint8_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++)
+	{
+		for (uint8_t phase = 0; phase < TIMER_SLOTS; phase += 7)
+		{
+			Reset();
+			Tick(phase);
+			uint32_t start = now;
+			Timer_Start(&eventA, timeouts[i]);
+			Tick(timeouts[i] - 1);
+			CHECK(firedA == 0 && Timer_Running(&eventA), "%u ticks from phase %u: fired early", timeouts[i], phase);
+			Tick(1);
+			CHECK(firedA == 1 && atA == start + timeouts[i], "%u ticks from phase %u: fired %u times, at %u",
+			      timeouts[i], phase, firedA, atA - start);
+			CHECK(!Timer_Running(&eventA), "%u ticks: still running after it fired", timeouts[i]);
+			Tick(2 * TIMER_SLOTS);
+			CHECK(firedA == 1, "%u ticks: fired again", timeouts[i]);
+		}
+	}
+}
+
+/* Milliseconds round up to whole ticks: never early, less than a tick late */
+static void TestMilliseconds(void)
+{
+	static const uint16_t timeouts[] = { 1, 32, 33, 200 };
+	for (uint8_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++)
+	{
+		Reset();
+		uint32_t start = now;
+		Timer_Start(&eventA, TIMER_MS(timeouts[i]));
+		uint32_t due = timeouts[i] * 1000UL;
+		while (!firedA && (now - start) * TICK_US < due + TICK_US)
+			Tick(1);
+		uint32_t us = (atA - start) * TICK_US;
+		CHECK(firedA == 1 && us >= due && us < due + TICK_US, "%ums fired after %uus", timeouts[i], us);
+	}
+	CHECK(TIMER_MS(1) == 1 && TIMER_MS(TICK_US / 1000) == 1 && TIMER_MS(TICK_US / 1000 + 1) == 2, "TIMER_MS rounding");
+	CHECK(TIMER_MS(65535) == (65535000UL + TICK_US - 1) / TICK_US, "TIMER_MS overflows");
+}
+
+/* 0 is the next tick, anything past TIMER_MAX_TICKS is cut to it rather than wrapping short */
+static void TestLimits(void)
+{
+	Reset();
+	uint32_t start = now;
+	Timer_Start(&eventA, 0);
+	Tick(1);
+	CHECK(firedA == 1 && atA == start + 1, "0 ticks fired after %u", atA - start);
+
+	static const uint16_t timeouts[] = { TIMER_MAX_TICKS + 1, TIMER_MAX_TICKS + TIMER_SLOTS, 65535 };
+	for (uint8_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++)
+	{
+		Reset();
+		start = now;
+		Timer_Start(&eventA, timeouts[i]);
+		Tick(TIMER_MAX_TICKS);
+		CHECK(firedA == 1 && atA == start + TIMER_MAX_TICKS, "%u ticks fired %u times, after %u", timeouts[i], firedA, atA - start);
+	}
+}
+
+/* Restarting moves the expiry, longer or shorter, across slots and turns */
+static void TestRestart(void)
+{
+	Reset();
+	uint32_t start = now;
+	Timer_Start(&eventA, 10);
+	Tick(5);
+	Timer_Start(&eventA, 10);
+	Tick(9);
+	CHECK(firedA == 0, "fired at the first expiry");
+	Tick(1);
+	CHECK(firedA == 1 && atA == start + 15, "longer restart fired after %u", atA - start);
+
+	Reset();
+	start = now;
+	Timer_Start(&eventA, 3 * TIMER_SLOTS);
+	Tick(1);
+	Timer_Start(&eventA, 2);
+	Tick(2 * TIMER_SLOTS + 2);
+	CHECK(firedA == 1 && atA == start + 3, "shorter restart fired %u times, after %u", firedA, atA - start);
+
+	// Restart into the same slot a turn later, with others in it
+	Reset();
+	start = now;
+	Timer_Start(&eventB, TIMER_SLOTS);
+	Timer_Start(&eventA, TIMER_SLOTS);
+	Timer_Start(&eventC, TIMER_SLOTS);
+	Timer_Start(&eventA, 2 * TIMER_SLOTS);
+	Tick(2 * TIMER_SLOTS);
+	CHECK(firedB == 1 && atB == start + TIMER_SLOTS && firedC == 1 && atC == start + TIMER_SLOTS, "slot mates lost");
+	CHECK(firedA == 1 && atA == start + 2 * TIMER_SLOTS, "restart a turn on fired after %u", atA - start);
+}
+
+static void TestStop(void)
+{
+	Reset();
+	Timer_Stop(&eventA); // Not running
+	CHECK(!Timer_Running(&eventA), "stopped event running");
+
+	Timer_Start(&eventA, 5);
+	Timer_Start(&eventB, 5);
+	Timer_Start(&eventC, 5);
+	CHECK(Timer_Running(&eventA), "started event not running");
+	Timer_Stop(&eventB); // Middle of its slot
+	Timer_Stop(&eventB);
+	CHECK(!Timer_Running(&eventB), "still running after stop");
+	Tick(4 * TIMER_SLOTS);
+	CHECK(firedA == 1 && firedB == 0 && firedC == 1, "fired A %u B %u C %u", firedA, firedB, firedC);
+
+	// Stopped across turns, then started again
+	Reset();
+	uint32_t start = now;
+	Timer_Start(&eventA, 3 * TIMER_SLOTS);
+	Tick(TIMER_SLOTS + 1);
+	Timer_Stop(&eventA);
+	Tick(3 * TIMER_SLOTS);
+	CHECK(firedA == 0, "fired after stop");
+	start = now;
+	Timer_Start(&eventA, 7);
+	Tick(7);
+	CHECK(firedA == 1 && atA == start + 7, "restart after stop fired after %u", atA - start);
+}
+
+/* Handlers re-arming themselves and starting or stopping others from inside Timer_Tick() */
+static uint16_t rearmPeriod;
+static uint32_t rearmFired, rearmLast, rearmWorst, rearmBest;
+static void Rearm(void);
+static Timer_Event_t rearmEvent = { .handler = Rearm };
+static void Rearm(void)
+{
+	if (rearmFired++)
+	{
+		uint32_t period = now - rearmLast;
+		if (period > rearmWorst)
+			rearmWorst = period;
+		if (period < rearmBest)
+			rearmBest = period;
+	}
+	rearmLast = now;
+	Timer_Start(&rearmEvent, rearmPeriod); // From this tick, like statsTimeout()
+}
+
+static void StopB(void) { firedA++; atA = now; Timer_Stop(&eventB); }
+static void StartC(void) { firedA++; atA = now; Timer_Start(&eventC, 1); }
+static void StartCSameSlot(void) { firedA++; atA = now; Timer_Start(&eventC, TIMER_SLOTS); }
+
+static void TestHandlers(void)
+{
+	static const uint16_t periods[] = { 1, 5, TIMER_SLOTS, TIMER_SLOTS + 8, 200 };
+	for (uint8_t i = 0; i < sizeof(periods) / sizeof(periods[0]); i++)
+	{
+		rearmPeriod = periods[i];
+		rearmFired = rearmWorst = 0;
+		rearmBest = UINT32_MAX;
+		Timer_Start(&rearmEvent, rearmPeriod);
+		Tick(20 * rearmPeriod);
+		Timer_Stop(&rearmEvent);
+		CHECK(rearmFired == 20 && rearmBest == rearmPeriod && rearmWorst == rearmPeriod,
+		      "period %u: fired %u times, every %u to %u ticks", rearmPeriod, rearmFired, rearmBest, rearmWorst);
+	}
+
+	// A stops B, both due on the same tick, B after A in the slot
+	Reset();
+	eventA.handler = StopB;
+	Timer_Start(&eventB, 3);
+	Timer_Start(&eventA, 3);
+	Tick(3 + TIMER_SLOTS);
+	CHECK(firedA == 1 && firedB == 0, "stopped from a handler: A %u B %u", firedA, firedB);
+
+	// A starts C for the next tick, and for a full turn: C lands in the slot being walked
+	Reset();
+	eventA.handler = StartC;
+	uint32_t start = now;
+	Timer_Start(&eventA, 4);
+	Tick(6);
+	CHECK(firedC == 1 && atC == start + 5, "started from a handler fired %u times, after %u", firedC, atC - start);
+
+	Reset();
+	eventA.handler = StartCSameSlot;
+	start = now;
+	Timer_Start(&eventA, 4);
+	Tick(4);
+	CHECK(firedC == 0, "started into the slot being walked, fired on the same tick");
+	Tick(TIMER_SLOTS);
+	CHECK(firedC == 1 && atC == start + 4 + TIMER_SLOTS, "started into the slot being walked fired after %u", atC - start);
+	eventA.handler = FireA;
+}
+
+/* Many timers at once, each fires on its own tick exactly once */
+#define MANY 1000
+static Timer_Event_t many[MANY];
+static uint32_t manyDue[MANY];
+static uint32_t manyFired;
+static void ManyFired(void) { manyFired++; }
+
+static void TestMany(void)
+{
+	srand(1);
+	uint32_t start = now;
+	for (uint16_t i = 0; i < MANY; i++)
+	{
+		uint16_t ticks = 1 + rand() % (4 * TIMER_SLOTS);
+		many[i].handler = ManyFired;
+		manyDue[i] = start + ticks;
+		Timer_Start(&many[i], ticks);
+		if (i % 3 == 0) // Restart some to a new expiry
+		{
+			ticks = 1 + rand() % (4 * TIMER_SLOTS);
+			manyDue[i] = start + ticks;
+			Timer_Start(&many[i], ticks);
+		}
+	}
+	uint32_t wrong = 0;
+	for (uint16_t t = 0; t <= 4 * TIMER_SLOTS; t++)
+	{
+		uint32_t before = manyFired;
+		Tick(1);
+		uint32_t due = 0;
+		for (uint16_t i = 0; i < MANY; i++)
+		{
+			if (manyDue[i] == now)
+				due++;
+			if (Timer_Running(&many[i]) != (manyDue[i] > now))
+				wrong++;
+		}
+		CHECK(manyFired - before == due, "tick %u: %u fired, %u due", now - start, manyFired - before, due);
+	}
+	CHECK(wrong == 0 && manyFired == MANY, "%u events in the wrong state, %u of %u fired", wrong, manyFired, MANY);
+}
+
+/* Benchmark: Timer_Start() restarting a running event and Timer_Tick() with n timers running,
+   spread over the wheel on long timeouts. Start costs the same at any n; a tick walks its
+   slot, about n / TIMER_SLOTS events, so its cost per event walked stays the same */
+static uint64_t Nanoseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define BENCH_MAX      16384
+#define BENCH_STARTS   2000000
+#define BENCH_TICKS    1000 // Times BENCH_REPEATS, short of TIMER_MAX_TICKS so nothing fires
+#define BENCH_REPEATS  5
+static Timer_Event_t bench[BENCH_MAX];
+static void BenchFired(void) { }
+
+static double BenchStart(Timer_Event_t* events, uint16_t count)
+{
+	double best = 1e9;
+	for (uint8_t r = 0; r < BENCH_REPEATS; r++)
+	{
+		uint64_t t = Nanoseconds();
+		for (uint32_t i = 0; i < BENCH_STARTS; i++)
+			Timer_Start(&events[i % count], TIMER_MAX_TICKS - (i & 0xFF));
+		double ns = (double)(Nanoseconds() - t) / BENCH_STARTS;
+		if (ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+static double BenchTick(void)
+{
+	double best = 1e9;
+	for (uint8_t r = 0; r < BENCH_REPEATS; r++)
+	{
+		uint64_t t = Nanoseconds();
+		Tick(BENCH_TICKS);
+		double ns = (double)(Nanoseconds() - t) / BENCH_TICKS;
+		if (ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+static void Benchmark(void)
+{
+	static Timer_Event_t probes[16];
+	for (uint8_t i = 0; i < 16; i++)
+		probes[i].handler = BenchFired;
+
+	printf("%8s %14s %12s %18s\n", "timers", "start ns", "tick ns", "tick ns per event");
+	double first = 0, last = 0;
+	for (uint32_t count = 0; count <= BENCH_MAX; count = count ? count * 4 : 16)
+	{
+		// count timers running on timeouts longer than the run, all over the wheel
+		for (uint32_t i = 0; i < BENCH_MAX; i++)
+			Timer_Stop(&bench[i]);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			bench[i].handler = BenchFired;
+			Timer_Start(&bench[i], TIMER_MAX_TICKS - (i % TIMER_SLOTS));
+		}
+		double start = BenchStart(probes, 16);
+		double tick = BenchTick(); // Background timers lose turns but don't fire
+		double walked = (count + TIMER_SLOTS - 1) / TIMER_SLOTS + 16.0 / TIMER_SLOTS;
+		printf("%8u %14.1f %12.1f %18.2f\n", count, start, tick, tick / walked);
+		if (!count)
+			first = start;
+		last = start;
+	}
+	for (uint32_t i = 0; i < BENCH_MAX; i++)
+		Timer_Stop(&bench[i]);
+	// Loose bound, this only has to catch a start that walks lists
+	CHECK(last < 4 * first + 20, "Timer_Start %.1fns with %u timers running against %.1fns with none", last, BENCH_MAX, first);
+}
+
+int main(int argc, char* argv[])
+{
+	bool bench = !(argc > 1 && !strcmp(argv[1], "-q"));
+
+	TestExpiry();
+	TestMilliseconds();
+	TestLimits();
+	TestRestart();
+	TestStop();
+	TestHandlers();
+	TestMany();
+	printf("timers: %u failed checks\n", failures);
+	if (bench)
+		Benchmark();
+	return failures ? 1 : 0;
+}
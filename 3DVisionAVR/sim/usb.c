@@ -0,0 +1,376 @@
+/** \file
+ *
+ *  Minimal model of the LUFA device-mode endpoint API. OUT endpoints have one or two banks;
+ *  OUT packets queued by the stimulus wait (are NAKed) until the firmware frees a bank,
+ *  IN packets are taken by the host as soon as the firmware commits them.
+ *
+ *  The bus runs in 1ms frames: the host sends a packet it was handed in the next frame,
+ *  shortly after the SOF, and every SOF raises the USB_GEN start of frame interrupt. An OUT
+ *  packet in a bank with RXOUTE set raises USB_COM until the firmware masks or releases it.
+ */
+
+#include <LUFA/Drivers/USB/USB.h>
+#include "sim.h"
+
+#define SIM_ENDPOINTS    8
+#define SIM_OUT_QUEUE    64
+
+typedef struct
+{
+	uint8_t  Data[SIM_MAX_PACKET];
+	uint8_t  Length;
+	int32_t  Tag;
+	uint64_t LandedAt;
+} Sim_Bank_t;
+
+typedef struct
+{
+	bool     Configured;
+	bool     In;        /**< Direction it was configured for, one per endpoint number like the hardware */
+	uint8_t  Type;
+	uint16_t Size;
+	uint8_t  Banks;
+
+	uint8_t  Data[SIM_MAX_PACKET];
+	uint8_t  Length;
+	uint8_t  Position;
+	bool     Full;      /**< OUT: packet waiting for the firmware, IN: packet waiting for the host */
+	int32_t  Tag;       /**< Replay packet index of the OUT packet in the bank, -1 if none */
+	uint8_t  Enable;    /**< UEIENX, interrupt enables, only RXOUTE is acted on */
+	uint64_t LandedAt;  /**< OUT: when the packet in the bank arrived */
+	bool     SpareFull; /**< OUT, double banked: next packet already received */
+	Sim_Bank_t Spare;
+} Sim_Endpoint_t;
+
+typedef struct
+{
+	uint64_t Due;       /**< Earliest bus time the host sends the packet */
+	uint8_t  Address;
+	uint8_t  Length;
+	uint8_t  Data[SIM_MAX_PACKET];
+	int32_t  Tag;
+} Sim_Packet_t;
+
+USB_Request_Header_t USB_ControlRequest;
+volatile uint8_t     USB_DeviceState = DEVICE_STATE_Unattached;
+volatile uint8_t     UDIEN;
+volatile uint16_t    Sim_USB_Flags;
+volatile uint8_t     Sim_USB_ComEnable = 1;
+volatile uint16_t    Sim_USB_ComFlags;
+Sim_USB_Latency_t    Sim_USB_Latency;
+
+static Sim_Endpoint_t Endpoints[SIM_ENDPOINTS];
+static uint8_t        SelectedEndpoint;
+
+static Sim_Packet_t   OutQueue[SIM_OUT_QUEUE];
+static uint8_t        OutQueueHead;
+static uint8_t        OutQueueTail;
+
+static double         NextSOF;     /**< Bus time of the next start of frame, in ticks */
+
+void __attribute__((weak)) EVENT_USB_Device_StartOfFrame(void)
+{
+}
+
+void __attribute__((weak)) EVENT_USB_Device_Reset(void)
+{
+}
+
+/* LUFA's general USB interrupt, reduced to the start of frame event */
+void Sim_Vect_USB_GEN(void)
+{
+	EVENT_USB_Device_StartOfFrame();
+}
+
+static Sim_Endpoint_t* CurrentEndpoint(void)
+{
+	return &Endpoints[SelectedEndpoint & ENDPOINT_EPNUM_MASK];
+}
+
+/** Current endpoint for IN (in) or OUT use. A configured data endpoint only works in the direction
+ *  it was last configured for, the other address on its number doesn't exist for the hardware */
+static Sim_Endpoint_t* DirectedEndpoint(bool in)
+{
+	Sim_Endpoint_t* ep = CurrentEndpoint();
+	if (ep->Configured && (SelectedEndpoint & ENDPOINT_EPNUM_MASK) != ENDPOINT_CONTROLEP && ep->In != in)
+		Sim_Fatal("endpoint %02X used for %s but configured as %s", SelectedEndpoint, in ? "IN" : "OUT", ep->In ? "IN" : "OUT");
+	return ep;
+}
+
+void USB_Init(void)
+{
+	USB_DeviceState = DEVICE_STATE_Powered;
+}
+
+void USB_USBTask(void)
+{
+	Sim_Yield(Sim_Config.LoopTicks);
+}
+
+void USB_Device_ProcessControlRequest(void)
+{
+}
+
+volatile uint8_t* Sim_UEIENX(void)
+{
+	return &CurrentEndpoint()->Enable;
+}
+
+/* Endpoints with an interrupt pending, one bit per endpoint number */
+uint8_t Sim_UEINT(void)
+{
+	uint8_t pending = 0;
+	for (uint8_t i = 0; i < SIM_ENDPOINTS; i++)
+	{
+		if (Endpoints[i].Configured && Endpoints[i].Full && (Endpoints[i].Enable & _BV(RXOUTE)))
+			pending |= _BV(i);
+	}
+	return pending;
+}
+
+/** Enumerates the device, called once the firmware reaches its main loop */
+void Sim_USB_Start(void)
+{
+	USB_DeviceState = DEVICE_STATE_Configured;
+	NextSOF = Sim_Now + SIM_USB_FRAME;
+	EVENT_USB_Device_Connect();
+	EVENT_USB_Device_Reset();
+	EVENT_USB_Device_ConfigurationChanged();
+}
+
+/** Queues a host to device packet, delivered as soon as the endpoint bank is free. A tag other
+ *  than -1 reports its delivery and release to the replay */
+void Sim_USB_QueueOUT(uint8_t address, const uint8_t* data, uint8_t length, int32_t tag)
+{
+	uint8_t next = (OutQueueHead + 1) % SIM_OUT_QUEUE;
+	if (next == OutQueueTail)
+		Sim_Fatal("USB OUT queue overflow, firmware stopped reading endpoint %02X", address);
+
+	/* Goes out in the next frame at the earliest */
+	Sim_Packet_t* packet = &OutQueue[OutQueueHead];
+	packet->Due     = (uint64_t)NextSOF + SIM_USB_BULK_OFFSET;
+	packet->Address = address;
+	packet->Length  = length;
+	packet->Tag     = tag;
+	memcpy(packet->Data, data, length);
+	OutQueueHead = next;
+}
+
+/** Generates bus frames and moves queued packets into free endpoint banks */
+void Sim_USB_Tick(void)
+{
+	if (USB_DeviceState == DEVICE_STATE_Configured && Sim_Now >= NextSOF)
+	{
+		NextSOF += SIM_USB_FRAME * (1.0 + Sim_Config.UsbClockPPM * 1e-6);
+		Sim_USB_Flags |= _BV(SOFI);
+		Sim_Marker(SIM_MARKER_SOF);
+	}
+
+	while (OutQueueTail != OutQueueHead)
+	{
+		Sim_Packet_t*   packet = &OutQueue[OutQueueTail];
+		Sim_Endpoint_t* ep     = &Endpoints[packet->Address & ENDPOINT_EPNUM_MASK];
+		if (Sim_Now < packet->Due || !ep->Configured || ep->SpareFull || (ep->Full && ep->Banks < 2))
+			break; // Not sent yet or NAK, host retries later - later packets are queued behind this one
+
+		if (ep->Full)
+		{
+			Sim_Bank_t* bank = &ep->Spare;
+			memcpy(bank->Data, packet->Data, packet->Length);
+			bank->Length   = packet->Length;
+			bank->Tag      = packet->Tag;
+			bank->LandedAt = Sim_Now;
+			ep->SpareFull  = true;
+		}
+		else
+		{
+			memcpy(ep->Data, packet->Data, packet->Length);
+			ep->Length   = packet->Length;
+			ep->Position = 0;
+			ep->Full     = true;
+			ep->Tag      = packet->Tag;
+			ep->LandedAt = Sim_Now;
+		}
+		if (packet->Tag >= 0)
+			Sim_Replay_Delivered(packet->Tag);
+		OutQueueTail = (OutQueueTail + 1) % SIM_OUT_QUEUE;
+		Sim_Marker(SIM_MARKER_SwapPacket);
+	}
+
+	Sim_USB_ComFlags = (Sim_UEINT() != 0);
+}
+
+bool Endpoint_ConfigureEndpoint(const uint8_t Address, const uint8_t Type, const uint16_t Size, const uint8_t Banks)
+{
+	Sim_Endpoint_t* ep = &Endpoints[Address & ENDPOINT_EPNUM_MASK];
+	if (Size > SIM_MAX_PACKET)
+		return false;
+
+	memset(ep, 0, sizeof(*ep));
+	ep->Configured = true;
+	ep->In         = (Address & ENDPOINT_DIR_IN) != 0;
+	ep->Type       = Type;
+	ep->Size       = Size;
+	ep->Banks      = Banks;
+	return true;
+}
+
+void Endpoint_SelectEndpoint(const uint8_t Address)
+{
+	SelectedEndpoint = Address;
+}
+
+uint8_t Endpoint_GetCurrentEndpoint(void)
+{
+	return SelectedEndpoint;
+}
+
+bool Endpoint_IsConfigured(void)
+{
+	return CurrentEndpoint()->Configured;
+}
+
+bool Endpoint_IsReadWriteAllowed(void)
+{
+	Sim_Endpoint_t* ep = CurrentEndpoint();
+	if (SelectedEndpoint & ENDPOINT_DIR_IN)
+		return !ep->Full && (ep->Length < ep->Size);
+	return ep->Full && (ep->Position < ep->Length);
+}
+
+bool Endpoint_IsOUTReceived(void)
+{
+	return !(SelectedEndpoint & ENDPOINT_DIR_IN) && DirectedEndpoint(false)->Full;
+}
+
+bool Endpoint_IsINReady(void)
+{
+	return (SelectedEndpoint & ENDPOINT_DIR_IN) && DirectedEndpoint(true)->Configured && !CurrentEndpoint()->Full;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void)
+{
+	Sim_Endpoint_t* ep = CurrentEndpoint();
+	if (SelectedEndpoint & ENDPOINT_DIR_IN)
+		return ep->Length;
+	return ep->Length - ep->Position;
+}
+
+void Endpoint_ClearOUT(void)
+{
+	Sim_Endpoint_t* ep = CurrentEndpoint();
+	if (ep->Full && ep->Tag >= 0)
+		Sim_Replay_Processed(ep->Tag);
+	if (ep->Full)
+	{
+		uint64_t wait = Sim_Now - ep->LandedAt;
+		Sim_USB_Latency.Packets++;
+		Sim_USB_Latency.Sum += wait;
+		if (wait > Sim_USB_Latency.Max)
+			Sim_USB_Latency.Max = wait;
+	}
+	ep->Tag      = -1;
+	ep->Full     = false;
+	ep->Length   = 0;
+	ep->Position = 0;
+
+	/* Switch to the other bank */
+	if (ep->SpareFull)
+	{
+		memcpy(ep->Data, ep->Spare.Data, ep->Spare.Length);
+		ep->Length    = ep->Spare.Length;
+		ep->Tag       = ep->Spare.Tag;
+		ep->LandedAt  = ep->Spare.LandedAt;
+		ep->Full      = true;
+		ep->SpareFull = false;
+	}
+}
+
+void Endpoint_ClearIN(void)
+{
+	/* The simulated host reads IN data straight away */
+	Sim_Endpoint_t* ep = DirectedEndpoint(true);
+	Sim_ReceiveIN(SelectedEndpoint, ep->Data, ep->Length);
+	Sim_Replay_ReceiveIN(SelectedEndpoint, ep->Data, ep->Length);
+	ep->Full     = false;
+	ep->Length   = 0;
+	ep->Position = 0;
+}
+
+uint8_t Endpoint_WaitUntilReady(void)
+{
+	return ENDPOINT_READYWAIT_NoError;
+}
+
+uint8_t Endpoint_Read_8(void)
+{
+	Sim_Endpoint_t* ep = CurrentEndpoint();
+	if (ep->Position >= ep->Length)
+		return 0;
+	return ep->Data[ep->Position++];
+}
+
+void Endpoint_Write_8(const uint8_t Data)
+{
+	Sim_Endpoint_t* ep = DirectedEndpoint(true);
+	if (ep->Length < ep->Size)
+		ep->Data[ep->Length++] = Data;
+}
+
+void Endpoint_Write_16_LE(const uint16_t Data)
+{
+	Endpoint_Write_8(Data);
+	Endpoint_Write_8(Data >> 8);
+}
+
+void Endpoint_Write_32_LE(const uint32_t Data)
+{
+	Endpoint_Write_16_LE(Data);
+	Endpoint_Write_16_LE(Data >> 16);
+}
+
+uint8_t Endpoint_Read_Stream_LE(void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed)
+{
+	uint8_t* data = Buffer;
+	for (uint16_t i = 0; i < Length; i++)
+		data[i] = Endpoint_Read_8();
+	if (BytesProcessed)
+		*BytesProcessed = Length;
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed)
+{
+	const uint8_t* data = Buffer;
+	for (uint16_t i = 0; i < Length; i++)
+		Endpoint_Write_8(data[i]);
+	if (BytesProcessed)
+		*BytesProcessed = Length;
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Discard_Stream(uint16_t Length, uint16_t* const BytesProcessed)
+{
+	for (uint16_t i = 0; i < Length; i++)
+		Endpoint_Read_8();
+	if (BytesProcessed)
+		*BytesProcessed = Length;
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Null_Stream(uint16_t Length, uint16_t* const BytesProcessed)
+{
+	for (uint16_t i = 0; i < Length; i++)
+		Endpoint_Write_8(0);
+	if (BytesProcessed)
+		*BytesProcessed = Length;
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+void Endpoint_ClearSETUP(void)
+{
+}
+
+void Endpoint_ClearStatusStage(void)
+{
+}
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""
+Reader for the emitter's ISR profile (CMD_PROFILE), firmware built with EMITTER_PROFILE.
+
+Prints calls, shortest, average and longest handler time, worst entry latency and the
+main loop iteration rate, then clears the profile so the next table starts afresh:
+
+    profile_reader.py                every second until interrupted
+    profile_reader.py -i 5000        every five seconds
+    profile_reader.py --once         totals since power up or the last clear, not cleared
+
+Handler times run from the PROFILE_ISR line to the return, without the prologue and
+epilogue. Needs pyusb and access to the device (VID 0955, PID 0007). Reply layout mirrors
+CMD_PROFILE in 3DVisionAVR/Emitter.h, vector order Profile_Vector_t in Profile.h.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+VENDOR_ID = 0x0955
+PRODUCT_ID = 0x0007
+EP_CONTROL_OUT = 0x02
+EP_CONTROL_IN = 0x84
+
+CMD_PROFILE = 0x99
+TICKS_PER_US = 2
+
+VECTORS = ("TIMER1_COMPA", "TIMER1_COMPB", "TIMER1_COMPC", "TIMER1_CAPT", "TIMER1_OVF",
+           "INT1", "USART1_UDRE", "USB_COM", "USB SOF")
+
+
+def request(device, index, clear=False):
+    device.write(EP_CONTROL_OUT, bytes([CMD_PROFILE, index, 1 if clear else 0, 0]))
+    while True:
+        reply = bytes(device.read(EP_CONTROL_IN, 32, timeout=500))
+        if len(reply) >= 4 and reply[0] == CMD_PROFILE and reply[1] == index:
+            return reply
+
+
+def read_profile(device, clear):
+    """Vector records and the main loop record, the profile cleared after the last if asked"""
+    first = request(device, 0)
+    count = first[2]
+    if count == 0:
+        sys.exit("profile_reader: firmware built without EMITTER_PROFILE")
+    vectors = [first] + [request(device, i) for i in range(1, count)]
+    loop = request(device, count, clear)
+    return ([struct.unpack_from("<IIIHH", reply, 4) for reply in vectors],
+            struct.unpack_from("<III", loop, 4))
+
+
+def print_profile(vectors, loop):
+    loops, ticks, f_cpu = loop
+    seconds = ticks / (TICKS_PER_US * 1e6)
+    cycles_us = f_cpu / 1e6
+    busy = 0
+    print("%-13s %9s %8s %8s %8s %8s %11s" % ("vector", "calls", "per s", "min us", "avg us", "max us", "latency us"))
+    for index, (calls, total, longest, shortest, latency) in enumerate(vectors):
+        if not calls:
+            continue
+        busy += total
+        name = VECTORS[index] if index < len(VECTORS) else "vector %d" % index
+        print("%-13s %9d %8.0f %8.2f %8.2f %8.2f %11.1f" %
+              (name, calls, calls / seconds if seconds else 0.0, shortest / cycles_us,
+               total / calls / cycles_us, longest / cycles_us, latency / TICKS_PER_US))
+    print("main loop %d iterations, %.0f/s over %.3f s, handlers busy %.2f%%\n" %
+          (loops, loops / seconds if seconds else 0.0, seconds,
+           busy * 100.0 / (f_cpu * seconds) if seconds else 0.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Show the emitter's ISR profile")
+    parser.add_argument("-i", "--interval", type=int, default=1000, metavar="MS",
+                        help="time between tables (default 1000)")
+    parser.add_argument("--once", action="store_true", help="print the profile as it is and exit, without clearing it")
+    args = parser.parse_args()
+
+    try:
+        import usb.core
+    except ImportError:
+        sys.exit("profile_reader: needs pyusb (pip install pyusb)")
+
+    device = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+    if device is None:
+        sys.exit("profile_reader: emitter %04x:%04x not found" % (VENDOR_ID, PRODUCT_ID))
+
+    if args.once:
+        print_profile(*read_profile(device, False))
+        return
+
+    read_profile(device, True)
+    try:
+        while True:
+            time.sleep(args.interval / 1000.0)
+            print_profile(*read_profile(device, True))
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""
+Live reader for the emitter's sync statistics (EMITTER_EP_STATS_IN).
+
+Enables publishing with CMD_STATS_RATE, then prints one line per snapshot with the
+counter changes since the previous one, and the interval/latency histograms every
+few lines:
+
+    stats_reader.py                  every 500ms until interrupted
+    stats_reader.py -i 1000 -H 10    every second, histograms every 10 lines
+    stats_reader.py --off            stop publishing and exit
+
+Needs pyusb and access to the device (VID 0955, PID 0007). Packet layout mirrors
+the STATS_* defines in 3DVisionAVR/Emitter.h and IR_Stats_t in IREmitter.h.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+VENDOR_ID = 0x0955
+PRODUCT_ID = 0x0007
+EP_CONTROL_OUT = 0x02
+EP_STATS_IN = 0x83
+
+CMD_STATS_RATE = 0x94
+STATS_TAG = 0x53
+STATS_PAGES = 3
+STATS_BINS = 8
+TICKS_PER_US = 2
+
+MODES = {0: "none", 1: "driver", 2: "external", 3: "combined", 4: "freerun"}
+PROTOCOLS = {0: "samsung07", 1: "xpand", 2: "3dvision", 3: "sharp", 4: "sony", 5: "panasonic", 0xFF: "uploaded"}
+
+
+class Snapshot:
+    def __init__(self, pages):
+        header, counters, histograms = pages[0][:4], pages[0][4:], pages[1:]
+        self.sequence, self.mode = header[2], header[3]
+        (right, left, missed, late, timeouts, fixes,
+         period, window, dropped, protocol, glitches, slips) = struct.unpack_from("<IIHHHHHHHBHH", counters)
+        self.frames = (right, left)
+        self.counters = (missed, late, timeouts, fixes, glitches, slips)
+        self.period = period / TICKS_PER_US
+        self.window = window / TICKS_PER_US
+        self.dropped = dropped
+        self.protocol = protocol
+        self.histograms = [struct.unpack_from("<%dH" % STATS_BINS, page, 4) for page in histograms]
+        self.time = time.monotonic()
+
+
+def wrap(new, old, bits=16):
+    return (new - old) & ((1 << bits) - 1)
+
+
+def read_snapshots(device, timeout_ms):
+    """Yields complete snapshots, pages of one snapshot share a sequence number"""
+    pages = [None] * STATS_PAGES
+    while True:
+        try:
+            packet = bytes(device.read(EP_STATS_IN, 32, timeout=timeout_ms))
+        except Exception as error:  # usb.core.USBTimeoutError on older pyusb is a plain USBError
+            if "timed out" in str(error).lower():
+                continue
+            raise
+        if len(packet) < 4 or packet[0] != STATS_TAG or packet[1] >= STATS_PAGES:
+            continue
+        pages[packet[1]] = packet
+        if packet[1] == STATS_PAGES - 1 and all(p is not None and p[2] == packet[2] for p in pages):
+            yield Snapshot(pages)
+            pages = [None] * STATS_PAGES
+
+
+def print_histograms(snapshot):
+    """Totals since power up, the counts wrap at 65536"""
+    for name, unit, index in (("interval error", 1, 0), ("sync to pulse", 8, 1)):
+        bins = snapshot.histograms[index]
+        labels = ["<%d" % (unit << n) for n in range(STATS_BINS - 1)] + [">=%d" % (unit << (STATS_BINS - 2))]
+        print("  %-15s" % (name + " us"), " ".join("%6s" % label for label in labels))
+        print("  %-15s" % "", " ".join("%6d" % count for count in bins))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Show the emitter's sync statistics")
+    parser.add_argument("-i", "--interval", type=int, default=500, metavar="MS",
+                        help="snapshot interval, 10..2550 ms (default 500)")
+    parser.add_argument("-H", "--histograms", type=int, default=20, metavar="N",
+                        help="print the histograms every N lines, 0 for never (default 20)")
+    parser.add_argument("--off", action="store_true", help="stop publishing and exit")
+    args = parser.parse_args()
+
+    try:
+        import usb.core
+    except ImportError:
+        sys.exit("stats_reader: needs pyusb (pip install pyusb)")
+
+    device = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+    if device is None:
+        sys.exit("stats_reader: emitter %04x:%04x not found" % (VENDOR_ID, PRODUCT_ID))
+
+    rate = 0 if args.off else max(1, min(255, (args.interval + 9) // 10))
+    device.write(EP_CONTROL_OUT, bytes([CMD_STATS_RATE, rate, 0, 0]))
+    if args.off:
+        return
+
+    print("%8s %-8s %-9s %8s %7s %7s %7s %6s %6s %6s %6s %6s %6s %9s %8s" %
+          ("seq", "mode", "protocol", "frames", "R", "L", "fps", "missed", "late", "tmout", "eyefix", "glitch", "slip",
+           "period", "window"))
+    previous, lines = None, 0
+    try:
+        for snapshot in read_snapshots(device, rate * 10 * 4):
+            frames = [wrap(new, old, 32) for new, old in zip(snapshot.frames, previous.frames)] if previous else [0, 0]
+            counters = [wrap(new, old) for new, old in zip(snapshot.counters, previous.counters)] if previous else [0] * 6
+            elapsed = snapshot.time - previous.time if previous else 0
+            fps = sum(frames) / elapsed if elapsed else 0.0
+            flags = " UART -%d" % wrap(snapshot.dropped, previous.dropped) if previous and snapshot.dropped != previous.dropped else ""
+            print("%8d %-8s %-9s %8d %7d %7d %7.2f %6d %6d %6d %6d %6d %6d %9.1f %8.1f%s" %
+                  (snapshot.sequence, MODES.get(snapshot.mode, "?"), PROTOCOLS.get(snapshot.protocol, "?"),
+                   sum(snapshot.frames), frames[0], frames[1], fps, *counters, snapshot.period, snapshot.window, flags))
+            lines += 1
+            if args.histograms and lines % args.histograms == 0:
+                print_histograms(snapshot)
+            previous = snapshot
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
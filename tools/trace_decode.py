@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""
+Decoder for the emitter's binary UART trace (firmware built with EMITTER_TRACE).
+
+Reads the raw USART1 byte stream, from a serial port dump or the simulator's -u file,
+and prints a per-frame latency table or the full event timeline:
+
+    trace_decode.py capture.bin              frames, late ones marked
+    trace_decode.py -t capture.bin           every record
+    trace_decode.py -l 15 capture.bin        mark frames more than 15us behind their sync
+
+Record layout and event IDs mirror the TRACE_* defines in 3DVisionAVR/Emitter.h.
+"""
+
+import argparse
+import statistics
+import sys
+
+RECORD_SIZE = 7
+CHECK = 0x5A
+TICKS_PER_US = 2
+TIME_WRAP = 1 << 24
+
+SYNC_EDGE    = 0x10
+SYNC_GLITCH  = 0x18
+FRAME_START  = 0x20
+FRAME_LATE   = 0x28
+TOKEN_START  = 0x30
+TOKEN_END    = 0x40
+SWAP_PACKET  = 0x50
+COMMAND      = 0x60
+SYNC_TIMEOUT = 0x70
+
+EYES = ("right", "left")
+TOKENS = ("open R", "close R", "open L", "close L")
+
+
+class Record:
+    def __init__(self, event, time, payload):
+        self.event = event
+        self.time = time        # Unwrapped Timer1 ticks
+        self.payload = payload
+
+    def stamp(self):
+        """Full time of a 16-bit Timer1 value in the payload, taken shortly before the record"""
+        return self.time - ((self.time - self.payload) & 0xFFFF)
+
+    def kind(self):
+        return self.event & 0xF8 if self.event & 0xF0 in (0x10, 0x20) else self.event & 0xF0
+
+
+def parse(data):
+    """Splits the stream into records, resyncing on check byte mismatches"""
+    records, skipped = [], 0
+    offset, last, base = 0, None, 0
+    while offset + RECORD_SIZE <= len(data):
+        chunk = data[offset:offset + RECORD_SIZE]
+        check = CHECK
+        for byte in chunk[:-1]:
+            check ^= byte
+        if check != chunk[-1]:
+            offset += 1
+            skipped += 1
+            continue
+
+        time = chunk[1] | (chunk[2] << 8) | (chunk[3] << 16)
+        if last is not None and time < last:
+            base += TIME_WRAP
+        last = time
+        records.append(Record(chunk[0], base + time, chunk[4] | (chunk[5] << 8)))
+        offset += RECORD_SIZE
+    return records, skipped
+
+
+def us(ticks):
+    return ticks / TICKS_PER_US
+
+
+def describe(record):
+    kind, low = record.kind(), record.event & 0x07
+    if kind == SYNC_EDGE:
+        return "sync edge    %-5s at %.1f" % ("high" if low else "low", us(record.stamp()))
+    if kind == SYNC_GLITCH:
+        return "sync glitch  %-5s at %.1f" % ("high" if low else "low", us(record.stamp()))
+    if kind == FRAME_START:
+        return "frame start  %-5s from %.1f" % (EYES[low & 1], us(record.stamp()))
+    if kind == FRAME_LATE:
+        return "frame late   shifted %.1fus" % us(record.payload)
+    if kind == TOKEN_START:
+        return "token start  %-7s edge %.1f" % (TOKENS[low & 3], us(record.stamp()))
+    if kind == TOKEN_END:
+        return "token end    %-7s edge %.1f" % (TOKENS[low & 3], us(record.stamp()))
+    if kind == SWAP_PACKET:
+        return "swap packet  %-5s SOF %.1f" % (EYES[low & 1], us(record.stamp()))
+    if kind == COMMAND:
+        return "command      %02X offset %02X" % (record.payload & 0xFF, record.payload >> 8)
+    if kind == SYNC_TIMEOUT:
+        return "sync timeout"
+    return "unknown %02X payload %04X" % (record.event, record.payload)
+
+
+class Frame:
+    def __init__(self, record, sync):
+        self.time = record.time
+        self.eye = record.event & 1
+        self.start = record.stamp()
+        self.sync = sync           # Sync edge time the frame was started from, None for PLL/free-run
+        self.shift = 0
+        self.tokens = {}           # token index -> [start edge, end edge, ISR delay at start]
+
+    def first_edge(self):
+        token = self.tokens.get(self.eye * 2)
+        return token[0] if token and token[0] is not None else None
+
+
+def frames(records):
+    result, sync, frame = [], None, None
+    for record in records:
+        kind = record.kind()
+        if kind == SYNC_EDGE:
+            sync = record.stamp()
+            if frame is not None and frame.sync is None and frame.start == sync:
+                frame.sync, sync = sync, None  # Traced after the frame it started
+        elif kind == FRAME_START:
+            # A frame started within a millisecond of the sync edge was started by it
+            frame = Frame(record, sync if sync is not None and record.time - sync < 2000 else None)
+            result.append(frame)
+            sync = None
+        elif frame is None:
+            continue
+        elif kind == FRAME_LATE:
+            frame.shift = record.payload
+        elif kind == TOKEN_START:
+            frame.tokens[record.event & 3] = [record.stamp(), None, record.time - record.stamp()]
+        elif kind == TOKEN_END:
+            frame.tokens.setdefault(record.event & 3, [None, None, 0])[1] = record.stamp()
+    return result
+
+
+def print_frames(result, late_us):
+    latencies = [us(f.first_edge() - f.sync) for f in result if f.sync is not None and f.first_edge() is not None]
+    typical = statistics.median(latencies) if latencies else 0.0
+
+    print("%6s %10s %-5s %9s %9s %8s %8s %9s %9s  %s" %
+          ("frame", "time ms", "eye", "latency", "isr us", "shift", "open us", "window", "interval", "notes"))
+    previous, late = None, 0
+    for index, frame in enumerate(result):
+        notes = []
+        first = frame.first_edge()
+        opening = frame.tokens.get(frame.eye * 2)
+        closing = frame.tokens.get(frame.eye * 2 + 1)
+
+        latency = ""
+        if frame.sync is not None and first is not None:
+            value = us(first - frame.sync)
+            latency = "%.1f" % value
+            if value > typical + late_us:
+                notes.append("LATE")
+        elif frame.sync is None:
+            latency = "pll/free"
+        if first is None:
+            notes.append("NO TOKEN")
+        if frame.shift:
+            notes.append("SHIFTED")
+        if opening and opening[1] is None:
+            notes.append("CUT SHORT")
+
+        isr = "%.1f" % us(opening[2]) if opening else ""
+        duration = "%.1f" % us(opening[1] - opening[0]) if opening and None not in opening[:2] else ""
+        window = ""
+        if opening and closing and opening[1] is not None and closing[0] is not None:
+            window = "%.1f" % us(closing[0] - opening[1])
+        interval = "%.3f" % (us(frame.start - previous.start) / 1000) if previous else ""
+        if notes:
+            late += 1
+
+        print("%6d %10.3f %-5s %9s %9s %8.1f %8s %9s %9s  %s" %
+              (index, us(frame.time) / 1000, EYES[frame.eye], latency, isr, us(frame.shift),
+               duration, window, interval, " ".join(notes)))
+        previous = frame
+
+    print()
+    print("%d frames, %d flagged" % (len(result), late), end="")
+    if latencies:
+        print(", sync to first pulse min %.1f median %.1f max %.1f us" % (min(latencies), typical, max(latencies)))
+    else:
+        print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode the emitter's binary UART trace")
+    parser.add_argument("file", help="raw USART1 capture, - for stdin")
+    parser.add_argument("-t", "--timeline", action="store_true", help="print every record instead of the frame table")
+    parser.add_argument("-l", "--late", type=float, default=5.0, metavar="US",
+                        help="flag frames this far behind the median sync latency (default 5)")
+    args = parser.parse_args()
+
+    data = sys.stdin.buffer.read() if args.file == "-" else open(args.file, "rb").read()
+    records, skipped = parse(data)
+    if skipped:
+        print("skipped %d bytes of broken records" % skipped, file=sys.stderr)
+
+    if args.timeline:
+        origin = records[0].time if records else 0
+        for record in records:
+            print("%12.1f  %s" % (us(record.time - origin), describe(record)))
+    else:
+        print_frames(frames(records), args.late)
+
+
+if __name__ == "__main__":
+    main()